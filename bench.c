@@ -0,0 +1,487 @@
+/* ------------------------------------------------------------------------
+   (C) 2018 by Roland Genske <roland@genske.org>
+
+   Workaround for FRITZ!App Fon SIP via VPN
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   ------------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------------
+   parser and rewrite microbenchmark, make bench
+
+   Runs next_packet(), the client.c rewrites and packet_iov(), which
+   applies them, over FRITZ!App Fon messages as in the README. Output is
+   tab separated, one line per message and operation:
+
+      message operation bytes ns_per_msg bytes_per_s allocs_per_msg
+
+   A batch of calls is timed between two clock reads. next_packet()
+   parses the message again for each call. The message is parsed once
+   for the rewrites, the rewrites before the timed one applied, and the
+   operation called repeatedly on it. Figures are the best of BENCH_RUNS
+   runs.
+   ------------------------------------------------------------------------ */
+
+/* client.c static rewrite functions */
+#include "client.c"
+
+#include <time.h>
+#include <stdarg.h>
+
+
+/* ------------------------------------------------------------------------
+   stubs, fapfon_proxy.c is not linked
+   ------------------------------------------------------------------------ */
+
+options_t options;
+
+void log_printf(enum loglevel_t level, const char *fmt, ...)
+{
+   va_list va;
+
+   if (level > LOG_ERROR)
+      return;
+
+   va_start(va, fmt);
+   vfprintf(stderr, fmt, va);
+   va_end(va);
+   fputc('\n', stderr);
+}
+
+void log_dump(enum loglevel_t level, const void *bufp, uint32_t len)
+{
+}
+
+
+/* ------------------------------------------------------------------------
+   allocation counter, linked with -Wl,--wrap=malloc,...
+   ------------------------------------------------------------------------ */
+
+static uint64_t bench_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+   bench_allocs++;
+   return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+   bench_allocs++;
+   return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+   bench_allocs++;
+   return __real_realloc(ptr, size);
+}
+
+
+/* ------------------------------------------------------------------------
+   corpus
+
+   Addresses as in the README: Fon app 10.81.179.54:61211 behind the
+   OpenVPN endpoint 172.20.11.6:62895, Box 172.30.10.1:5060, proxy
+   172.30.10.2:43202.
+   ------------------------------------------------------------------------ */
+
+/* binary form set by bench_corpus() */
+#define BENCH_ADDR(a, p) \
+   { .addr = a, .port = p, .addr_l = sizeof(a) - 1, .port_l = sizeof(p) - 1 }
+
+static addr_t fon_contact = BENCH_ADDR("10.81.179.54", "61211"),
+                    fon_peer = BENCH_ADDR("172.20.11.6", "62895"),
+                    proxy_local = BENCH_ADDR("172.30.10.2", "43202");
+
+#define BENCH_SDP(addr) \
+   "v=0\r\n" \
+   "o=- 3727522826 3727522826 IN IP4 " addr "\r\n" \
+   "s=pjmedia\r\n" \
+   "c=IN IP4 " addr "\r\n" \
+   "t=0 0\r\n" \
+   "a=X-nat:0\r\n" \
+   "m=audio 4000 RTP/AVP 8 0 3 101\r\n" \
+   "a=rtcp:4001 IN IP4 " addr "\r\n" \
+   "a=rtpmap:8 PCMA/8000\r\n" \
+   "a=rtpmap:0 PCMU/8000\r\n" \
+   "a=rtpmap:3 GSM/8000\r\n" \
+   "a=sendrecv\r\n" \
+   "a=rtpmap:101 telephone-event/8000\r\n" \
+   "a=fmtp:101 0-15\r\n"
+
+typedef struct
+{
+   const char *name;
+   const char *header, *body;    /* header up to Content-Length value */
+   const addr_t *from, *to;      /* modify_header/modify_data */
+   const addr_t *rport;          /* modify_via_rport, NULL: Fon message */
+   char *data;
+   uint32_t data_l;
+}
+bench_msg_t;
+
+static bench_msg_t bench_msg[] =
+{
+   {
+      "register",
+
+      "REGISTER sip:172.30.10.1;transport=TCP SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport;branch=z9hG4bKPj1;alias\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t1\r\n"
+      "To: <sip:USERNAME@172.30.10.1>\r\n"
+      "Call-ID: c1\r\n"
+      "CSeq: 24441 REGISTER\r\n"
+      "User-Agent: FRITZ!AppFon/2549 sip/1.16.0\r\n"
+      "Supported: outbound, path\r\n"
+      "Contact: <sip:USERNAME@10.81.179.54:61211;transport=TCP;ob>"
+         ";reg-id=1;+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-"
+         "000000000000>\"\r\n"
+      "Expires: 900\r\n"
+      "Allow: PRACK, INVITE, ACK, BYE, CANCEL, UPDATE, INFO, SUBSCRIBE,"
+         " NOTIFY, REFER, MESSAGE, OPTIONS\r\n"
+      "Content-Length:  ",
+      "",
+      &fon_contact, &proxy_local, NULL
+   },
+   {
+      "register_ok",
+
+      "SIP/2.0 200 OK\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport=43202;branch=z9hG4bKPj1"
+         ";alias;received=172.30.10.2\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t1\r\n"
+      "To: <sip:USERNAME@172.30.10.1>;tag=t2\r\n"
+      "Call-ID: c1\r\n"
+      "CSeq: 24441 REGISTER\r\n"
+      "Contact: <sip:USERNAME@172.30.10.2:43202;transport=TCP;ob>"
+         ";expires=900\r\n"
+      "Date: Fri, 09 Feb 2018 12:00:00 GMT\r\n"
+      "User-Agent: FRITZ!OS\r\n"
+      "Content-Length: ",
+      "",
+      &proxy_local, &fon_contact, &fon_peer
+   },
+   {
+      "invite",
+
+      "INVITE sip:PHONENUMBER@172.30.10.1;transport=TCP SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport;branch=z9hG4bKPj2;alias\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t3\r\n"
+      "To: <sip:PHONENUMBER@172.30.10.1>\r\n"
+      "Contact: <sip:USERNAME@10.81.179.54:61211;transport=TCP;ob>\r\n"
+      "Call-ID: c2\r\n"
+      "CSeq: 10 INVITE\r\n"
+      "Allow: PRACK, INVITE, ACK, BYE, CANCEL, UPDATE, INFO, SUBSCRIBE,"
+         " NOTIFY, REFER, MESSAGE, OPTIONS\r\n"
+      "Supported: replaces, 100rel, timer, norefersub\r\n"
+      "Session-Expires: 1800\r\n"
+      "Min-SE: 90\r\n"
+      "User-Agent: FRITZ!AppFon/2549 sip/1.16.0\r\n"
+      "Content-Type: application/sdp\r\n"
+      "Content-Length:   ",
+      BENCH_SDP("10.81.179.54"),
+      &fon_contact, &proxy_local, NULL
+   },
+   {
+      "invite_ok",
+
+      "SIP/2.0 200 OK\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport=43202;branch=z9hG4bKPj2"
+         ";alias;received=172.30.10.2\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t3\r\n"
+      "To: <sip:PHONENUMBER@172.30.10.1>;tag=t4\r\n"
+      "Call-ID: c2\r\n"
+      "CSeq: 10 INVITE\r\n"
+      "Contact: <sip:PHONENUMBER@172.30.10.1;transport=TCP>\r\n"
+      "Allow: INVITE, ACK, OPTIONS, CANCEL, BYE, UPDATE, PRACK, INFO,"
+         " SUBSCRIBE, NOTIFY, REFER, MESSAGE\r\n"
+      "Supported: 100rel, replaces, timer\r\n"
+      "Session-Expires: 1800;refresher=uac\r\n"
+      "User-Agent: FRITZ!OS\r\n"
+      "Content-Type: application/sdp\r\n"
+      "Content-Length: ",
+      BENCH_SDP("172.30.10.1"),
+      &fon_peer, &fon_contact, &fon_peer
+   },
+   {
+      "notify",
+
+      "NOTIFY sip:USERNAME@172.30.10.2:43202;transport=TCP;ob SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 172.30.10.1:5060;branch=z9hG4bK3\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t5\r\n"
+      "To: <sip:USERNAME@172.30.10.1>;tag=t6\r\n"
+      "Call-ID: c3\r\n"
+      "CSeq: 3 NOTIFY\r\n"
+      "Contact: <sip:172.30.10.1;transport=TCP>\r\n"
+      "Event: message-summary\r\n"
+      "Subscription-State: active;expires=3600\r\n"
+      "User-Agent: FRITZ!OS\r\n"
+      "Content-Type: application/simple-message-summary\r\n"
+      "Content-Length: ",
+      "Messages-Waiting: no\r\n"
+      "Message-Account: sip:USERNAME@172.30.10.1\r\n"
+      "Voice-Message: 0/0 (0/0)\r\n",
+      &proxy_local, &fon_contact, &fon_peer
+   }
+};
+
+#define BENCH_MSGS (sizeof(bench_msg) / sizeof(bench_msg[0]))
+
+static int bench_corpus(void)
+{
+   uint32_t m;
+
+   addr_binary(&fon_contact);
+   addr_binary(&fon_peer);
+   addr_binary(&proxy_local);
+
+   for (m = 0; m < BENCH_MSGS; m++)
+   {
+      bench_msg_t *msg = bench_msg + m;
+      int l = snprintf(NULL, 0, "%s%u\r\n\r\n%s",
+                       msg->header, (uint32_t)strlen(msg->body), msg->body);
+
+      msg->data = malloc(l + 1);
+      if (msg->data == NULL)
+      {
+         log_printf(LOG_ERROR, "bench_corpus:"
+            " Memory allocation failed (%d bytes)", l + 1);
+         return 0;
+      }
+
+      msg->data_l = sprintf(msg->data, "%s%u\r\n\r\n%s",
+                            msg->header, (uint32_t)strlen(msg->body),
+                            msg->body);
+   }
+
+   return 1;
+}
+
+
+/* ------------------------------------------------------------------------
+   benchmark
+   ------------------------------------------------------------------------ */
+
+enum bench_op_t
+{
+   OP_NEXT_PACKET,
+   OP_MODIFY_HEADER,
+   OP_MODIFY_DATA,
+   OP_MODIFY_VIA_RPORT,
+   OP_MODIFY_CONTENT_LENGTH,
+   OP_PACKET_IOV,
+   OP_COUNT
+};
+
+static const char *const bench_op_name[OP_COUNT] =
+{
+   "next_packet",
+   "modify_header",
+   "modify_data",
+   "modify_via_rport",
+   "modify_content_length",
+   "packet_iov"
+};
+
+typedef struct
+{
+   double ns;                    /* per message */
+   double allocs;                /* per message */
+}
+bench_result_t;
+
+#define BENCH_RUNS 5
+
+static uint64_t bench_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_loop(const bench_msg_t *msg, enum bench_op_t op,
+                      uint32_t iterations, bench_result_t *result)
+{
+   packet_t *packet = calloc(1, sizeof(packet_t));
+   packet_index_t *index;
+   struct iovec *iov;
+   rewrite_t rw;
+   uint64_t start_ns, allocs_before;
+   uint32_t n;
+   uint32_t splices;
+   int ok = 1;
+
+   if (packet == NULL)
+   {
+      log_printf(LOG_ERROR, "bench_loop:"
+         " Memory allocation failed (%u bytes)",
+         (unsigned int)sizeof(packet_t));
+      return 0;
+   }
+
+   /* per client, compiled once */
+   rewrite_compile(&rw, msg->from, msg->to);
+
+   if (op == OP_NEXT_PACKET)
+   {
+      /* previous message consumed, buffer reused */
+
+      allocs_before = bench_allocs;
+      start_ns = bench_ns();
+
+      for (n = 0; ok && n < iterations; n++)
+      {
+         ok = next_packet(packet, msg->data, msg->data_l)
+           && packet->status == PACKET_READY;
+      }
+
+      result->ns = (double)(bench_ns() - start_ns) / iterations;
+      result->allocs = (double)(bench_allocs - allocs_before) / iterations;
+   }
+   else {
+      /* parsed once, rewrites before the timed one applied untimed */
+
+      ok = next_packet(packet, msg->data, msg->data_l)
+        && packet->status == PACKET_READY
+        && (   op <= OP_MODIFY_HEADER
+            || modify_header(packet, &rw))
+        && (   op <= OP_MODIFY_DATA
+            || modify_data(packet, &rw))
+        && (   op <= OP_MODIFY_VIA_RPORT
+            || !msg->rport || modify_via_rport(packet, msg->rport))
+        && (   op <= OP_MODIFY_CONTENT_LENGTH
+            || modify_content_length(packet));
+
+      /* splice list restored before each call, the same edits are
+         recorded again */
+      index = packet_index(packet);
+      splices = index->splices;
+
+      allocs_before = bench_allocs;
+      start_ns = bench_ns();
+
+      for (n = 0; ok && n < iterations; n++)
+      {
+         index->splices = splices;
+
+         switch (op)
+         {
+            case OP_NEXT_PACKET:
+               break;
+
+            case OP_MODIFY_HEADER:
+               ok = modify_header(packet, &rw);
+               break;
+
+            case OP_MODIFY_DATA:
+               ok = modify_data(packet, &rw);
+               break;
+
+            case OP_MODIFY_VIA_RPORT:
+               ok = modify_via_rport(packet,
+                                     msg->rport ? msg->rport : msg->to);
+               break;
+
+            case OP_MODIFY_CONTENT_LENGTH:
+               ok = modify_content_length(packet);
+               break;
+
+            case OP_PACKET_IOV:
+               ok = packet_iov(packet, &iov) > 0;
+               break;
+
+            case OP_COUNT:
+               break;
+         }
+      }
+
+      result->ns = (double)(bench_ns() - start_ns) / iterations;
+      result->allocs = (double)(bench_allocs - allocs_before) / iterations;
+   }
+
+   buf_cleanup(&packet->buf);
+   free(packet);
+
+   if (!ok)
+   {
+      fprintf(stderr, "%s %s failed\n", msg->name, bench_op_name[op]);
+      return 0;
+   }
+
+   return 1;
+}
+
+int main(int argc, char *argv[])
+{
+   uint32_t iterations = 200000, m;
+   enum bench_op_t op;
+
+   if (argc > 1)
+   {
+      char *end_p;
+      long int n = strtol(argv[1], &end_p, 10);
+
+      if (*argv[1] == '\0' || *end_p != '\0' || n <= 0 || n > 100000000)
+      {
+         fprintf(stderr, "usage: %s [ITERATIONS]\n", argv[0]);
+         return 3;
+      }
+
+      iterations = n;
+   }
+
+   options.log_fp = stderr;
+   options.log_level = LOG_ERROR;
+   options.max_message = 64 * 1024;
+   options.body_type[options.body_types++] = "application/sdp";
+
+   if (!bench_corpus())
+      return 1;
+
+   printf("# fapfon-proxy %s bench, %u iterations\n",
+      VERSION_STRING, iterations);
+   printf("message\toperation\tbytes\tns_per_msg\tbytes_per_s"
+      "\tallocs_per_msg\n");
+
+   for (m = 0; m < BENCH_MSGS; m++)
+   {
+      const bench_msg_t *msg = bench_msg + m;
+      bench_result_t result, best;
+      int run;
+
+      /* warm up caches */
+      if (!bench_loop(msg, OP_NEXT_PACKET, iterations / 10 + 1, &result))
+         return 1;
+
+      for (op = OP_NEXT_PACKET; op < OP_COUNT; op++)
+      {
+         for (run = 0; run < BENCH_RUNS; run++)
+         {
+            if (!bench_loop(msg, op, iterations, &result))
+               return 1;
+
+            if (run == 0 || result.ns < best.ns)
+               best = result;
+         }
+
+         result = best;
+
+         printf("%s\t%s\t%u\t%.1f\t%.0f\t%.3f\n",
+            msg->name, bench_op_name[op], msg->data_l,
+            result.ns, msg->data_l * 1e9 / result.ns, result.allocs);
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,717 @@
+/* ------------------------------------------------------------------------
+   (C) 2018 by Roland Genske <roland@genske.org>
+
+   Workaround for FRITZ!App Fon SIP via VPN
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   ------------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------------
+   parser and rewrite checks, make check
+
+   Runs the FRITZ!App Fon messages of the README through next_packet()
+   and the client.c rewrites of a TCP connection and compares the bytes
+   packet_iov() yields with the expected message, also in compact header
+   form, split across reads at every offset and with a Content-Length
+   value growing wider. An ICE offer has more address fields than the
+   initial index sizes, another message more header lines. Over the
+   size limit, an SDP body is rejected and other bodies are streamed.
+   The address and line scanners are compared with a bytewise scan.
+   make check runs the checks built with the SIMD scanners of the
+   compiler target and again with the SWAR fallback.
+   ------------------------------------------------------------------------ */
+
+/* client.c static rewrite functions */
+#include "client.c"
+
+#include <stdarg.h>
+
+
+/* ------------------------------------------------------------------------
+   stubs, fapfon_proxy.c is not linked
+   ------------------------------------------------------------------------ */
+
+options_t options;
+
+void log_printf(enum loglevel_t level, const char *fmt, ...)
+{
+   va_list va;
+
+   if (level > LOG_ERROR)
+      return;
+
+   va_start(va, fmt);
+   vfprintf(stderr, fmt, va);
+   va_end(va);
+   fputc('\n', stderr);
+}
+
+void log_dump(enum loglevel_t level, const void *bufp, uint32_t len)
+{
+}
+
+
+/* ------------------------------------------------------------------------
+   messages
+
+   Addresses as in the README: Fon app 10.81.179.54:61211 behind the
+   OpenVPN endpoint 172.20.11.6:62895, Box 172.30.10.1:5060, proxy
+   172.30.10.2:43202.
+   ------------------------------------------------------------------------ */
+
+#define CHECK_ADDR(a, p) \
+   { .addr = a, .port = p, .addr_l = sizeof(a) - 1, .port_l = sizeof(p) - 1 }
+
+static client_context_t check_client =
+{
+   .fon.contact = CHECK_ADDR("10.81.179.54", "61211"),
+   .fon.tcp.peer = CHECK_ADDR("172.20.11.6", "62895"),
+   .box.tcp.local = CHECK_ADDR("172.30.10.2", "43202")
+};
+
+#define CHECK_SDP(addr) \
+   "v=0\r\n" \
+   "o=- 3727522826 3727522826 IN IP4 " addr "\r\n" \
+   "s=pjmedia\r\n" \
+   "c=IN IP4 " addr "\r\n" \
+   "t=0 0\r\n" \
+   "a=X-nat:0\r\n" \
+   "m=audio 4000 RTP/AVP 8 0 3 101\r\n" \
+   "a=rtcp:4001 IN IP4 " addr "\r\n" \
+   "a=rtpmap:8 PCMA/8000\r\n" \
+   "a=rtpmap:0 PCMU/8000\r\n" \
+   "a=rtpmap:3 GSM/8000\r\n" \
+   "a=sendrecv\r\n" \
+   "a=rtpmap:101 telephone-event/8000\r\n" \
+   "a=fmtp:101 0-15\r\n"
+
+typedef struct
+{
+   const char *name;
+   int to_box;                   /* Fon to Box, else Box to Fon */
+   const char *message, *expect;
+}
+check_msg_t;
+
+static const check_msg_t check_msg[] =
+{
+   {
+      "register", 1,
+
+      "REGISTER sip:172.30.10.1;transport=TCP SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport;branch=z9hG4bKPj1;alias\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t1\r\n"
+      "To: <sip:USERNAME@172.30.10.1>\r\n"
+      "Call-ID: c1\r\n"
+      "CSeq: 24441 REGISTER\r\n"
+      "User-Agent: FRITZ!AppFon/2549 sip/1.16.0\r\n"
+      "Supported: outbound, path\r\n"
+      "Contact: <sip:USERNAME@10.81.179.54:61211;transport=TCP;ob>"
+         ";reg-id=1;+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-"
+         "000000000000>\"\r\n"
+      "Expires: 900\r\n"
+      "Allow: PRACK, INVITE, ACK, BYE, CANCEL, UPDATE, INFO, SUBSCRIBE,"
+         " NOTIFY, REFER, MESSAGE, OPTIONS\r\n"
+      "Content-Length:  0\r\n"
+      "\r\n",
+
+      "REGISTER sip:172.30.10.1;transport=TCP SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport;branch=z9hG4bKPj1;alias\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t1\r\n"
+      "To: <sip:USERNAME@172.30.10.1>\r\n"
+      "Call-ID: c1\r\n"
+      "CSeq: 24441 REGISTER\r\n"
+      "User-Agent: FRITZ!AppFon/2549 sip/1.16.0\r\n"
+      "Supported: outbound, path\r\n"
+      "Contact: <sip:USERNAME@172.30.10.2:43202;transport=TCP;ob>"
+         ";reg-id=1;+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-"
+         "000000000000>\"\r\n"
+      "Expires: 900\r\n"
+      "Allow: PRACK, INVITE, ACK, BYE, CANCEL, UPDATE, INFO, SUBSCRIBE,"
+         " NOTIFY, REFER, MESSAGE, OPTIONS\r\n"
+      "Content-Length:  0\r\n"
+      "\r\n"
+   },
+   {
+      "register_ok", 0,
+
+      "SIP/2.0 200 OK\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport=43202;branch=z9hG4bKPj1"
+         ";alias;received=172.30.10.2\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t1\r\n"
+      "To: <sip:USERNAME@172.30.10.1>;tag=t2\r\n"
+      "Call-ID: c1\r\n"
+      "CSeq: 24441 REGISTER\r\n"
+      "Contact: <sip:USERNAME@172.30.10.2:43202;transport=TCP;ob>"
+         ";expires=900\r\n"
+      "User-Agent: FRITZ!OS\r\n"
+      "Content-Length: 0\r\n"
+      "\r\n",
+
+      "SIP/2.0 200 OK\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport=62895;branch=z9hG4bKPj1"
+         ";alias;received=172.30.10.2\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t1\r\n"
+      "To: <sip:USERNAME@172.30.10.1>;tag=t2\r\n"
+      "Call-ID: c1\r\n"
+      "CSeq: 24441 REGISTER\r\n"
+      "Contact: <sip:USERNAME@10.81.179.54:61211;transport=TCP;ob>"
+         ";expires=900\r\n"
+      "User-Agent: FRITZ!OS\r\n"
+      "Content-Length: 0\r\n"
+      "\r\n"
+   },
+   {
+      "invite", 1,
+
+      "INVITE sip:PHONENUMBER@172.30.10.1;transport=TCP SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport;branch=z9hG4bKPj2;alias\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t3\r\n"
+      "To: <sip:PHONENUMBER@172.30.10.1>\r\n"
+      "Contact: <sip:USERNAME@10.81.179.54:61211;transport=TCP;ob>\r\n"
+      "Call-ID: c2\r\n"
+      "CSeq: 10 INVITE\r\n"
+      "User-Agent: FRITZ!AppFon/2549 sip/1.16.0\r\n"
+      "Content-Type: application/sdp\r\n"
+      "Content-Length:   298\r\n"
+      "\r\n"
+      CHECK_SDP("10.81.179.54"),
+
+      "INVITE sip:PHONENUMBER@172.30.10.1;transport=TCP SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport;branch=z9hG4bKPj2;alias\r\n"
+      "Max-Forwards: 70\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t3\r\n"
+      "To: <sip:PHONENUMBER@172.30.10.1>\r\n"
+      "Contact: <sip:USERNAME@172.30.10.2:43202;transport=TCP;ob>\r\n"
+      "Call-ID: c2\r\n"
+      "CSeq: 10 INVITE\r\n"
+      "User-Agent: FRITZ!AppFon/2549 sip/1.16.0\r\n"
+      "Content-Type: application/sdp\r\n"
+      "Content-Length:   295\r\n"
+      "\r\n"
+      CHECK_SDP("172.20.11.6")
+   },
+   {
+      "invite_compact", 1,
+
+      "INVITE sip:PHONENUMBER@172.30.10.1;transport=TCP SIP/2.0\r\n"
+      "v: SIP/2.0/TCP 172.20.11.6:61211;rport;branch=z9hG4bKPj2;alias\r\n"
+      "f: <sip:USERNAME@172.30.10.1>;tag=t3\r\n"
+      "t: <sip:PHONENUMBER@172.30.10.1>\r\n"
+      "m: <sip:USERNAME@10.81.179.54:61211;transport=TCP;ob>\r\n"
+      "i: c2\r\n"
+      "CSeq: 10 INVITE\r\n"
+      "c: application/sdp\r\n"
+      "l:   298\r\n"
+      "\r\n"
+      CHECK_SDP("10.81.179.54"),
+
+      "INVITE sip:PHONENUMBER@172.30.10.1;transport=TCP SIP/2.0\r\n"
+      "v: SIP/2.0/TCP 172.20.11.6:61211;rport;branch=z9hG4bKPj2;alias\r\n"
+      "f: <sip:USERNAME@172.30.10.1>;tag=t3\r\n"
+      "t: <sip:PHONENUMBER@172.30.10.1>\r\n"
+      "m: <sip:USERNAME@172.30.10.2:43202;transport=TCP;ob>\r\n"
+      "i: c2\r\n"
+      "CSeq: 10 INVITE\r\n"
+      "c: application/sdp\r\n"
+      "l:   295\r\n"
+      "\r\n"
+      CHECK_SDP("172.20.11.6")
+   },
+   {
+      "invite_ok", 0,
+
+      "SIP/2.0 200 OK\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport=43202;branch=z9hG4bKPj2"
+         ";alias;received=172.30.10.2\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t3\r\n"
+      "To: <sip:PHONENUMBER@172.30.10.1>;tag=t4\r\n"
+      "Call-ID: c2\r\n"
+      "CSeq: 10 INVITE\r\n"
+      "Contact: <sip:PHONENUMBER@172.30.10.1;transport=TCP>\r\n"
+      "Content-Type: application/sdp\r\n"
+      "Content-Length: 295\r\n"
+      "\r\n"
+      CHECK_SDP("172.30.10.1"),
+
+      "SIP/2.0 200 OK\r\n"
+      "Via: SIP/2.0/TCP 172.20.11.6:61211;rport=62895;branch=z9hG4bKPj2"
+         ";alias;received=172.30.10.2\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t3\r\n"
+      "To: <sip:PHONENUMBER@172.30.10.1>;tag=t4\r\n"
+      "Call-ID: c2\r\n"
+      "CSeq: 10 INVITE\r\n"
+      "Contact: <sip:PHONENUMBER@172.30.10.1;transport=TCP>\r\n"
+      "Content-Type: application/sdp\r\n"
+      "Content-Length: 295\r\n"
+      "\r\n"
+      CHECK_SDP("172.30.10.1")
+   },
+   {
+      /* Content-Length 99 becomes 101, one digit wider */
+      "invite_box", 0,
+
+      "INVITE sip:USERNAME@172.30.10.2:43202;transport=TCP;ob SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 172.30.10.1:5060;branch=z9hG4bK5\r\n"
+      "From: <sip:PHONENUMBER@172.30.10.1>;tag=t7\r\n"
+      "To: <sip:USERNAME@172.30.10.1>\r\n"
+      "Call-ID: c5\r\n"
+      "CSeq: 1 INVITE\r\n"
+      "Contact: <sip:PHONENUMBER@172.30.10.1;transport=TCP>\r\n"
+      "Content-Type: application/sdp\r\n"
+      "Content-Length: 99\r\n"
+      "\r\n"
+      "v=0\r\n"
+      "o=- 1 1 IN IP4 172.20.11.6\r\n"
+      "s=voicecall\r\n"
+      "c=IN IP4 172.20.11.6\r\n"
+      "t=0 0\r\n"
+      "m=audio 4000 RTP/AVP 8\r\n",
+
+      "INVITE sip:USERNAME@10.81.179.54:61211;transport=TCP;ob SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 172.30.10.1:5060;branch=z9hG4bK5\r\n"
+      "From: <sip:PHONENUMBER@172.30.10.1>;tag=t7\r\n"
+      "To: <sip:USERNAME@172.30.10.1>\r\n"
+      "Call-ID: c5\r\n"
+      "CSeq: 1 INVITE\r\n"
+      "Contact: <sip:PHONENUMBER@172.30.10.1;transport=TCP>\r\n"
+      "Content-Type: application/sdp\r\n"
+      "Content-Length: 101\r\n"
+      "\r\n"
+      "v=0\r\n"
+      "o=- 1 1 IN IP4 10.81.179.54\r\n"
+      "s=voicecall\r\n"
+      "c=IN IP4 10.81.179.54\r\n"
+      "t=0 0\r\n"
+      "m=audio 4000 RTP/AVP 8\r\n"
+   },
+   {
+      "notify", 0,
+
+      "NOTIFY sip:USERNAME@172.30.10.2:43202;transport=TCP;ob SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 172.30.10.1:5060;branch=z9hG4bK3\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t5\r\n"
+      "To: <sip:USERNAME@172.30.10.1>;tag=t6\r\n"
+      "Call-ID: c3\r\n"
+      "CSeq: 3 NOTIFY\r\n"
+      "Contact: <sip:172.30.10.1;transport=TCP>\r\n"
+      "Event: message-summary\r\n"
+      "Content-Type: application/simple-message-summary\r\n"
+      "Content-Length: 52\r\n"
+      "\r\n"
+      "Messages-Waiting: no\r\n"
+      "Message-Account: 172.20.11.6\r\n",
+
+      "NOTIFY sip:USERNAME@10.81.179.54:61211;transport=TCP;ob SIP/2.0\r\n"
+      "Via: SIP/2.0/TCP 172.30.10.1:5060;branch=z9hG4bK3\r\n"
+      "From: <sip:USERNAME@172.30.10.1>;tag=t5\r\n"
+      "To: <sip:USERNAME@172.30.10.1>;tag=t6\r\n"
+      "Call-ID: c3\r\n"
+      "CSeq: 3 NOTIFY\r\n"
+      "Contact: <sip:172.30.10.1;transport=TCP>\r\n"
+      "Event: message-summary\r\n"
+      "Content-Type: application/simple-message-summary\r\n"
+      "Content-Length: 52\r\n"
+      "\r\n"
+      "Messages-Waiting: no\r\n"
+      "Message-Account: 172.20.11.6\r\n"
+   }
+};
+
+#define CHECK_MSGS (sizeof(check_msg) / sizeof(check_msg[0]))
+
+
+/* ------------------------------------------------------------------------
+   checks
+   ------------------------------------------------------------------------ */
+
+static uint32_t check_count, check_failed;
+
+static void check_fail(const char *name, const char *fmt, ...)
+{
+   va_list va;
+
+   fprintf(stderr, "FAIL %s: ", name);
+   va_start(va, fmt);
+   vfprintf(stderr, fmt, va);
+   va_end(va);
+   fputc('\n', stderr);
+
+   check_failed++;
+}
+
+static int check_parse(packet_t *packet, const char *data, uint32_t l)
+{
+   return next_packet(packet, data, l) && packet->status == PACKET_READY;
+}
+
+static void check_rewrite(const check_msg_t *msg, uint32_t split,
+                          int interleave)
+{
+   /* message received in two reads split at offset split, another
+      message parsed in between if interleave */
+
+   packet_t packet, other;
+   struct iovec *iov;
+   char out[8192];
+   uint32_t l = strlen(msg->message), out_l = 0;
+   int iov_n, i, ok;
+
+   memset(&packet, 0, sizeof(packet));
+   memset(&other, 0, sizeof(other));
+   check_count++;
+
+   ok = next_packet(&packet, msg->message, split);
+   if (ok && split < l)
+   {
+      ok = packet.status == PACKET_INCOMPLETE;
+
+      if (ok && interleave)
+         ok = check_parse(&other, check_msg[0].message,
+                          strlen(check_msg[0].message));
+
+      ok = ok && next_packet(&packet, msg->message + split, l - split);
+   }
+
+   if (!ok || packet.status != PACKET_READY)
+   {
+      check_fail(msg->name, "split %u%s not parsed", split,
+         interleave ? " interleaved" : "");
+      goto cleanup;
+   }
+
+   if (msg->to_box)
+   {
+      ok = modify_header(&packet, &check_client.plan.fon_header)
+        && modify_data(&packet, &check_client.plan.fon_data);
+   }
+   else {
+      ok = modify_via_rport(&packet, &check_client.fon.tcp.peer)
+        && modify_header(&packet, &check_client.plan.box_header)
+        && modify_data(&packet, &check_client.plan.box_data);
+   }
+
+   if (!ok || !modify_content_length(&packet))
+   {
+      check_fail(msg->name, "split %u%s not rewritten", split,
+         interleave ? " interleaved" : "");
+      goto cleanup;
+   }
+
+   iov_n = packet_iov(&packet, &iov);
+   for (i = 0; i < iov_n; i++)
+   {
+      if (out_l + iov[i].iov_len > sizeof(out))
+         break;
+
+      memcpy(out + out_l, iov[i].iov_base, iov[i].iov_len);
+      out_l += iov[i].iov_len;
+   }
+
+   if (   i < iov_n
+       || out_l != strlen(msg->expect)
+       || memcmp(out, msg->expect, out_l))
+   {
+      check_fail(msg->name, "split %u%s rewritten as\n%.*s", split,
+         interleave ? " interleaved" : "", (int)out_l, out);
+   }
+
+cleanup:
+   buf_cleanup(&packet.buf);
+   buf_cleanup(&other.buf);
+}
+
+#define CHECK_CANDIDATES 100
+
+static int check_ice_message(char *p, size_t size,
+                             const char *contact, const char *addr)
+{
+   /* INVITE with an ICE offer of CHECK_CANDIDATES a=candidate lines,
+      more address fields than the initial index and splice sizes */
+
+   char body[8192];
+   int body_l, i;
+
+   body_l = snprintf(body, sizeof(body),
+                     "v=0\r\n"
+                     "o=- 1 1 IN IP4 %s\r\n"
+                     "s=ice\r\n"
+                     "c=IN IP4 %s\r\n"
+                     "t=0 0\r\n"
+                     "m=audio 40000 RTP/AVP 8\r\n",
+                     addr, addr);
+
+   for (i = 0; i < CHECK_CANDIDATES; i++)
+   {
+      body_l += snprintf(body + body_l, sizeof(body) - body_l,
+                         "a=candidate:%d 1 udp %d %s %d typ host\r\n",
+                         i + 1, 2130706431 - i, addr, 40000 + 2 * i);
+   }
+
+   return snprintf(p, size,
+                   "INVITE sip:PHONENUMBER@172.30.10.1;transport=TCP"
+                      " SIP/2.0\r\n"
+                   "Via: SIP/2.0/TCP 172.20.11.6:61211;rport"
+                      ";branch=z9hG4bKPj8;alias\r\n"
+                   "From: <sip:USERNAME@172.30.10.1>;tag=t8\r\n"
+                   "To: <sip:PHONENUMBER@172.30.10.1>\r\n"
+                   "Contact: <sip:USERNAME@%s;transport=TCP;ob>\r\n"
+                   "Call-ID: c8\r\n"
+                   "CSeq: 10 INVITE\r\n"
+                   "Content-Type: application/sdp\r\n"
+                   "Content-Length: %d\r\n"
+                   "\r\n"
+                   "%s",
+                   contact, body_l, body);
+}
+
+static void check_ice(void)
+{
+   /* every address rewritten, whole and split */
+
+   char message[8192], expect[8192];
+   check_msg_t msg = { "invite_ice", 1, message, expect };
+   uint32_t l;
+
+   l = check_ice_message(message, sizeof(message),
+                         "10.81.179.54:61211", "10.81.179.54");
+   check_ice_message(expect, sizeof(expect),
+                     "172.30.10.2:43202", "172.20.11.6");
+
+   check_rewrite(&msg, l, 0);
+   check_rewrite(&msg, l / 2, 0);
+   check_rewrite(&msg, l / 2, 1);
+}
+
+static void check_limit(void)
+{
+   /* message over the size limit, SDP body rejected, body of another
+      type streamed */
+
+   char message[8192];
+   packet_t packet;
+   uint32_t max_message = options.max_message, l;
+
+   options.max_message = 1024;
+   l = check_ice_message(message, sizeof(message),
+                         "10.81.179.54:61211", "10.81.179.54");
+
+   memset(&packet, 0, sizeof(packet));
+   check_count++;
+
+   if (next_packet(&packet, message, l) || packet.status != PACKET_ERROR)
+      check_fail("limit", "SDP body of %u bytes not rejected", l);
+
+   buf_cleanup(&packet.buf);
+
+   memcpy(strstr(message, "application/sdp"), "text/plain;x=ab", 15);
+   memset(&packet, 0, sizeof(packet));
+   check_count++;
+
+   if (!check_parse(&packet, message, l) || !packet.streamed)
+      check_fail("limit", "text body of %u bytes not streamed", l);
+
+   buf_cleanup(&packet.buf);
+   options.max_message = max_message;
+}
+
+static uint32_t check_random(void)
+{
+   /* xorshift32, fixed seed, same input for every build */
+
+   static uint32_t x = 2463534242u;
+
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   return x;
+}
+
+static void check_scan(void)
+{
+   /* addr_scan() against a bytewise digit scan, all start offsets,
+      bytes >= 0x80 included for the signed SIMD compares */
+
+   static const char alphabet[] = "0123456789..........:: a\r\n\x80\xb9\xff";
+   char p[160];
+   int round;
+
+   for (round = 0; round < 2000; round++)
+   {
+      uint32_t l = check_random() % sizeof(p), i, start;
+
+      for (i = 0; i < l; i++)
+         p[i] = alphabet[check_random() % (sizeof(alphabet) - 1)];
+
+      for (start = 0; start <= l; start++)
+      {
+         addr_pos_t pos[ADDR_SCAN_MAX], ref[ADDR_SCAN_MAX];
+         data_t d;
+         int n, ref_n = 0, k;
+
+         d.p = p;
+         d.i = start;
+         d.l = l;
+         n = addr_scan(&d, pos, ADDR_SCAN_MAX);
+
+         for (i = start; ref_n < ADDR_SCAN_MAX && i < l; )
+         {
+            int addr_l;
+
+            if (!is_digit(p[i]))
+            {
+               i++;
+               continue;
+            }
+
+            if (addr_parse(p + i, l - i, &addr_l, &ref[ref_n].addr))
+            {
+               ref[ref_n].i = i;
+               ref[ref_n].l = addr_l;
+               ref_n++;
+            }
+
+            i += addr_l;
+         }
+
+         check_count++;
+         for (k = 0; k < n && k < ref_n; k++)
+         {
+            if (   pos[k].i != ref[k].i || pos[k].l != ref[k].l
+                || pos[k].addr != ref[k].addr)
+            {
+               break;
+            }
+         }
+
+         if (n != ref_n || k < n)
+         {
+            check_fail("addr_scan", "round %d offset %u: %d addresses,"
+               " expected %d", round, start, n, ref_n);
+            return;
+         }
+      }
+   }
+}
+
+static void check_lines(void)
+{
+   /* header lines of every length up to beyond the vector widths,
+      line ends found by next_packet() as laid out */
+
+   char msg[512], pad[100];
+   uint32_t pad_l;
+
+   /* "X-Pad: x" and pad */
+
+   for (pad_l = 0; pad_l < sizeof(pad); pad_l++)
+   {
+      packet_t packet;
+      int header_l, l;
+
+      memset(pad, pad_l & 1 ? 'a' : '\xb9', pad_l);
+      header_l = snprintf(msg, sizeof(msg),
+                          "OPTIONS sip:172.30.10.1 SIP/2.0\r\n"
+                          "X-Pad: x%.*s\r\n"
+                          "Via: SIP/2.0/TCP 172.20.11.6:61211\n"
+                          "From: <sip:USERNAME@172.30.10.1>\r\n"
+                          "To: <sip:USERNAME@172.30.10.1>\r\n"
+                          "X-Pad: x%.*s\n"
+                          "Content-Length: 2\r\n"
+                          "\r\n",
+                          (int)pad_l, pad, (int)pad_l, pad);
+      memcpy(msg + header_l, "\r\n", 2);
+      l = header_l + 2;
+
+      memset(&packet, 0, sizeof(packet));
+      check_count++;
+
+      if (   !check_parse(&packet, msg, l)
+          || packet.header.len != header_l
+          || packet.data.len != 2
+          || packet_index(&packet)->headers != 6)
+      {
+         check_fail("line_end", "header line of %u bytes", pad_l + 8);
+      }
+
+      buf_cleanup(&packet.buf);
+   }
+}
+
+static void check_headers(void)
+{
+   /* more header lines than the initial index size */
+
+   char msg[8192];
+   packet_t packet;
+   int l, i;
+
+   l = snprintf(msg, sizeof(msg),
+                "OPTIONS sip:172.30.10.1 SIP/2.0\r\n"
+                "Via: SIP/2.0/TCP 172.20.11.6:61211\r\n");
+   for (i = 0; i < 2 * PACKET_HEADERS; i++)
+   {
+      l += snprintf(msg + l, sizeof(msg) - l,
+                    "Record-Route: <sip:172.30.10.%d;lr>\r\n", i % 250 + 1);
+   }
+   l += snprintf(msg + l, sizeof(msg) - l,
+                 "From: <sip:USERNAME@172.30.10.1>;tag=t9\r\n"
+                 "To: <sip:USERNAME@172.30.10.1>\r\n"
+                 "CSeq: 1 OPTIONS\r\n"
+                 "Content-Length: 0\r\n"
+                 "\r\n");
+
+   memset(&packet, 0, sizeof(packet));
+   check_count++;
+
+   if (   !check_parse(&packet, msg, l)
+       || packet_index(&packet)->headers != 2 * PACKET_HEADERS + 5)
+   {
+      check_fail("headers", "%d header lines", 2 * PACKET_HEADERS + 5);
+   }
+
+   buf_cleanup(&packet.buf);
+}
+
+int main(int argc, char *argv[])
+{
+   uint32_t m, split;
+
+   options.log_fp = stderr;
+   options.log_level = LOG_ERROR;
+   options.max_message = 64 * 1024;
+   options.body_type[options.body_types++] = "application/sdp";
+
+   addr_binary(&check_client.fon.contact);
+   addr_binary(&check_client.fon.tcp.peer);
+   addr_binary(&check_client.box.tcp.local);
+   client_plan(&check_client);
+
+   for (m = 0; m < CHECK_MSGS; m++)
+   {
+      const check_msg_t *msg = check_msg + m;
+      uint32_t l = strlen(msg->message);
+
+      for (split = 1; split <= l; split++)
+      {
+         check_rewrite(msg, split, 0);
+         if (split < l)
+            check_rewrite(msg, split, 1);
+      }
+   }
+
+   check_ice();
+   check_limit();
+   check_scan();
+   check_lines();
+   check_headers();
+
+   printf("%s: %u checks, %u failed\n", argv[0], check_count, check_failed);
+   return check_failed != 0;
+}
@@ -38,19 +38,28 @@ typedef struct
 {
    int sfd;
    addr_t peer, local;
-   buf_t buf;
-   packet_t packet;
+   packet_t packet;              /* PACKET_READY: not yet forwarded */
+   int paused;                   /* output to opposite endpoint congested */
 }
 endpoint_t;
 
+typedef struct
+{
+   const addr_t *from, *to;      /* from NULL: no rewrite */
+}
+rewrite_t;
+
 typedef struct client_context
 {
-   struct client_context *next;
+   struct client_context *next, **prev_p;
    u_int32_t id;
    int connected;
 
    char *contact_id;
-   int16_t contact_id_l;
+   int contact_id_l;
+
+   timer_item_t timer;           /* registration expiry */
+   timer_item_t drain;           /* forward pipelined messages */
 
    struct
    {
@@ -64,18 +73,62 @@ typedef struct client_context
       endpoint_t tcp, udp;
    }
    box;
+
+   /* address rewrites, compiled by client_plan() once fon.contact
+      or fon.rtp is known */
+   struct
+   {
+      rewrite_t fon_header, fon_data;  /* Fon to Box */
+      rewrite_t box_header, box_data;  /* Box to Fon */
+   }
+   plan;
 }
 client_context_t;
 
-static client_context_t *client_list;
+static __thread client_context_t *client_list;   /* clients of this worker */
 static u_int32_t client_id;
 
+static void client_list_insert(client_context_t *client)
+{
+   client->next = client_list;
+   client->prev_p = &client_list;
+   if (client_list)
+      client_list->prev_p = &client->next;
+   client_list = client;
+}
+
+static void client_list_remove(client_context_t *client)
+{
+   *client->prev_p = client->next;
+   if (client->next)
+      client->next->prev_p = client->prev_p;
+   client->next = NULL;
+   client->prev_p = NULL;
+}
+
+static u_int32_t client_id_next(void)
+{
+   /* client identifiers are unique across workers */
+   return __atomic_add_fetch(&client_id, 1, __ATOMIC_RELAXED);
+}
+
+static void client_contact_register(client_context_t *client)
+{
+   contact_t contact;
+
+   contact.worker = worker_self();
+   contact.client_id = client->id;
+   contact_register(client->contact_id, client->contact_id_l, &contact);
+}
+
 
 /* ------------------------------------------------------------------------
-   temporary network receive buffer
+   UDP server socket receive batch
    ------------------------------------------------------------------------ */
 
-static buf_t tmp_buf;
+static __thread char *udp_data;
+static __thread udp_dgram_t udp_dgram[UDP_RECEIVE_BATCH];
+static __thread addr_t udp_local;             /* server port, cached */
 
 
 /* ------------------------------------------------------------------------
@@ -83,39 +136,52 @@ static buf_t tmp_buf;
    ------------------------------------------------------------------------ */
 
 static int modify_addr_port(packet_t *packet, data_t *d,
-                            const addr_t *from, const addr_t *to)
+                            const rewrite_t *rw)
 {
+   addr_pos_t pos[ADDR_SCAN_MAX];
+   int n, k;
+
    for (;;)
    {
-      /* locate next address */
+      /* locate next matching address */
 
       int addr_i, addr_l,
           port_i, port_l;
 
-      if ((addr_i = addr_find(d, &addr_l)) == -1)
-      {
-         /* no more addresses present */
-         break;
-      }
+      n = addr_scan(d, pos, ADDR_SCAN_MAX);
+      for (k = 0; k < n; k++)
+         if (pos[k].addr == rw->from->in_addr)
+            break;
 
-      if (from && (   addr_l != from->addr_l
-                   || memcmp(d->p + addr_i, from->addr, addr_l)))
+      if (k == n)
       {
-         /* from address does not match */
-         d->i = addr_i + addr_l;
+         if (n < ADDR_SCAN_MAX)
+         {
+            /* no more addresses present */
+            break;
+         }
+
+         d->i = pos[n - 1].i + pos[n - 1].l;
          continue;
       }
 
-      if (!data_modify(packet, d, addr_i, addr_l, to->addr, to->addr_l))
+      addr_i = pos[k].i;
+      addr_l = pos[k].l;
+      if (!data_splice(packet, d, addr_i, addr_l,
+                       rw->to->addr, rw->to->addr_l))
+      {
          return 0;
+      }
 
-      addr_l = to->addr_l;
       if ((port_i = port_find(d, addr_i, addr_l, &port_l)) != -1)
       {
-         if (!data_modify(packet, d, port_i, port_l, to->port, to->port_l))
+         if (!data_splice(packet, d, port_i, port_l,
+                          rw->to->port, rw->to->port_l))
+         {
             return 0;
+         }
 
-         d->i = port_i + to->port_l;
+         d->i = port_i + port_l;
       }
       else
          d->i = addr_i + addr_l;
@@ -129,18 +195,20 @@ static int modify_addr_port(packet_t *packet, data_t *d,
    modify header
    ------------------------------------------------------------------------ */
 
-static int modify_header(packet_t *packet,
-                         const addr_t *from, const addr_t *to)
+static int modify_header(packet_t *packet, const rewrite_t *rw)
 {
    data_t d;
 
+   if (rw->from == NULL)
+      return 1;
+
    /* before Via header */
 
    d.p = packet->buf.p;
    d.i = packet->method.len;
    d.l = packet->via_line.offs;
 
-   if (!modify_addr_port(packet, &d, from, to))
+   if (!modify_addr_port(packet, &d, rw))
       return 0;
 
    /* after Via header */
@@ -148,7 +216,7 @@ static int modify_header(packet_t *packet,
    d.i = packet->via_line.offs + packet->via_line.len;
    d.l = packet->header.len;
 
-   return modify_addr_port(packet, &d, from, to);
+   return modify_addr_port(packet, &d, rw);
 }
 
 
@@ -156,20 +224,45 @@ static int modify_header(packet_t *packet,
    modify data
    ------------------------------------------------------------------------ */
 
-static int modify_data(packet_t *packet,
-                       const addr_t *from, const addr_t *to)
+static int modify_data(packet_t *packet, const rewrite_t *rw)
 {
-   if (packet->data.len)
+   data_t d;
+
+   if (rw->from == NULL || packet->streamed || !packet->rewrite)
    {
-      data_t d;
+      /* body forwarded unmodified */
+      return 1;
+   }
 
-      d.p = packet->buf.p + packet->header.len;
-      d.i = 0;
-      d.l = packet->data.len;
+   d.p = packet->buf.p + packet->header.len;
+   d.i = 0;
+   d.l = packet->data.len;
 
-      if (!modify_addr_port(packet, &d, from, to))
-         return 0;
+   if (packet->sdp)
+   {
+      /* indexed SDP address fields only */
+
+      const packet_index_t *index = packet_index(packet);
+      int i;
+
+      for (i = 0; i < index->sdp_fields; i++)
+      {
+         const loc_t *addr = &index->sdp_field[i].addr;
+         uint32_t in_addr;
+         int l;
+
+         if (   addr_parse(d.p + addr->offs, addr->len, &l, &in_addr)
+             && l == addr->len
+             && in_addr == rw->from->in_addr
+             && !data_splice(packet, &d, addr->offs, addr->len,
+                             rw->to->addr, rw->to->addr_l))
+         {
+            return 0;
+         }
+      }
    }
+   else if (!modify_addr_port(packet, &d, rw))
+      return 0;
 
    return 1;
 }
@@ -182,37 +275,22 @@ static int modify_data(packet_t *packet,
 static int modify_via_rport(packet_t *packet, const addr_t *to)
 {
    data_t d;
+   int port_l;
 
-   d.p = packet->buf.p;
-   d.i = packet->via.offs;
-   d.l = d.i + packet->via.len;
+   /* rport parameter of the top Via, indexed by next_packet() */
 
-   while (d.i < d.l)
+   if (   packet->via_rport.len == 0
+       || !is_port(packet->buf.p + packet->via_rport.offs,
+                   packet->via_rport.len, &port_l))
    {
-      if (   d.p[d.i++] == ';'
-          && d.l - d.i > 6
-          && !strncasecmp(packet->buf.p + d.i, "rport=", 6))
-      {
-         int port_l;
-
-         d.i += 6;
-         if (is_port(packet->buf.p + d.i, d.l - d.i, &port_l))
-         {
-            if (!data_modify(packet, &d,
-                             d.i, port_l,
-                             to->port, to->port_l))
-            {
-               return 0;
-            }
-
-            port_l = to->port_l;
-         }
-
-         d.i += port_l;
-      }
+      return 1;
    }
 
-   return 1;
+   d.p = packet->buf.p;
+   d.i = packet->via_rport.offs;
+   d.l = d.i + packet->via_rport.len;
+
+   return data_splice(packet, &d, d.i, port_l, to->port, to->port_l);
 }
 
 
@@ -222,15 +300,95 @@ static int modify_via_rport(packet_t *packet, const addr_t *to)
 
 static int modify_content_length(packet_t *packet)
 {
+   const packet_index_t *index;
    data_t d;
-   char tmp[16];
-   int tmp_l = sprintf(tmp, " %d", packet->data.len);
+   char tmp[16], value[12];
+   int tmp_l, value_l, data_l = packet->data.len, i;
+
+   if (packet->streamed || !packet->rewrite)
+   {
+      /* body forwarded unmodified */
+      return 1;
+   }
+
+   /* body length after body splices */
+
+   index = packet_index(packet);
+   for (i = 0; i < index->splices; i++)
+   {
+      const splice_t *splice = index->splice + i;
+
+      if (splice->offs >= packet->header.len)
+         data_l += splice->with_l - (int)splice->len;
+   }
+
+   value_l = sprintf(value, "%d", data_l);
+
+   /* value and the spaces before it written once, right aligned to the
+      original width if that leaves a space, else after a single space */
+
+   for (i = packet->content_length.offs; packet->buf.p[i - 1] == ' '; i--)
+      ;
 
    d.p = packet->buf.p;
-   d.i = packet->content_length.offs;
-   d.l = packet->content_length.len;
+   d.i = i;
+   d.l = packet->content_length.offs + packet->content_length.len;
+
+   tmp_l = d.l - d.i;
+   if (tmp_l < value_l + 1 || tmp_l > (int)sizeof(tmp))
+      tmp_l = value_l + 1;
+
+   memset(tmp, ' ', tmp_l - value_l);
+   memcpy(tmp + tmp_l - value_l, value, value_l);
+
+   return data_splice(packet, &d, d.i, d.l - d.i, tmp, tmp_l);
+}
+
+
+/* ------------------------------------------------------------------------
+   rewrite plan
+
+   The addresses exchanged are fixed once the first Fon message has
+   given the Contact (TCP) or the first SDP body the RTP peer (UDP),
+   the plan is compiled then and used for all following messages.
+   ------------------------------------------------------------------------ */
+
+static void rewrite_compile(rewrite_t *rw, const addr_t *from, const addr_t *to)
+{
+   /* text of both rendered when the endpoints are set up */
+
+   assert(from->in_addr == 0 || from->addr_l != 0);
+   assert(to->addr_l != 0);
+
+   rw->from = from->in_addr ? from : NULL;
+   rw->to = to;
+}
+
+static void client_plan(client_context_t *client)
+{
+   if (client->fon.contact.addr_l)
+   {
+      /* TCP connection */
+
+      rewrite_compile(&client->plan.fon_header,
+                      &client->fon.contact, &client->box.tcp.local);
+      rewrite_compile(&client->plan.fon_data,
+                      &client->fon.contact, &client->fon.tcp.peer);
+
+      rewrite_compile(&client->plan.box_header,
+                      &client->box.tcp.local, &client->fon.contact);
+      rewrite_compile(&client->plan.box_data,
+                      &client->fon.tcp.peer, &client->fon.contact);
+   }
+   else if (client->fon.rtp.addr_l)
+   {
+      /* UDP connection, SIP header addresses unchanged */
 
-   return data_modify(packet, &d, d.i, d.l, tmp, tmp_l);
+      rewrite_compile(&client->plan.fon_data,
+                      &client->fon.rtp, &client->fon.udp.peer);
+      rewrite_compile(&client->plan.box_data,
+                      &client->fon.udp.peer, &client->fon.rtp);
+   }
 }
 
 
@@ -238,8 +396,8 @@ static int modify_content_length(packet_t *packet)
    get contact identifier if present
    ------------------------------------------------------------------------ */
 
-static int16_t contact_id(const packet_t *packet,
-                          const loc_t *loc, int16_t *l_p)
+static int contact_id(const packet_t *packet,
+                      const loc_t *loc, int *l_p)
 {
    int i = loc->offs, l = i + loc->len;
    if (i < l && packet->buf.p[i] == '<')
@@ -272,6 +430,156 @@ static void client_disconnect(client_context_t *client)
                                             : &client->fon.udp.sfd);
 }
 
+static void client_disconnect_worker(client_context_t *client,
+                                     const char *id, int id_l)
+{
+   /* contact identifier registered by other worker, disconnect there */
+
+   contact_t contact;
+   worker_msg_t *msg;
+
+   if (   !contact_lookup(id, id_l, &contact)
+       || contact.worker == worker_self())
+   {
+      return;
+   }
+
+   msg = calloc(1, sizeof(worker_msg_t));
+   if (msg == NULL)
+   {
+      log_printf(LOG_ERROR, "client_disconnect_worker:"
+         " Memory allocation failed (%u bytes)",
+         (unsigned int)sizeof(worker_msg_t));
+      return;
+   }
+
+   log_printf(LOG_VERBOSE, "[%u]"
+      " Disconnecting stale connection [%u] on worker %d",
+      client->id, contact.client_id, contact.worker);
+
+   msg->type = WORKER_MSG_DISCONNECT;
+   msg->client_id = contact.client_id;
+   worker_post(contact.worker, msg);
+}
+
+
+/* ------------------------------------------------------------------------
+   registration expiry
+
+   Clients are disconnected when the registration expires without being
+   refreshed, which also removes stale connections the peer did not close.
+   ------------------------------------------------------------------------ */
+
+#define REGISTER_DEFAULT_EXPIRES 3600        /* seconds */
+#define REGISTER_MAX_EXPIRES     (7*24*3600)
+#define CLIENT_EXPIRES_GRACE     32
+
+static int expires_value(const char *p, int l, uint32_t *expires_p)
+{
+   uint32_t expires = 0;
+   int i = 0;
+
+   while (i < l && (p[i] == ' ' || p[i] == '\t'))
+      i++;
+
+   if (i == l || p[i] < '0' || p[i] > '9')
+      return 0;
+
+   while (i < l && p[i] >= '0' && p[i] <= '9')
+   {
+      if (expires <= REGISTER_MAX_EXPIRES)
+         expires = expires * 10 + p[i] - '0';
+      i++;
+   }
+
+   *expires_p = expires < REGISTER_MAX_EXPIRES ? expires
+                                               : REGISTER_MAX_EXPIRES;
+   return 1;
+}
+
+static uint32_t register_expires(const packet_t *packet)
+{
+   const char *p = packet->buf.p + packet->contact.offs;
+   int i = 0, l = packet->contact.len;
+   uint32_t expires;
+
+   /* Contact expires parameter, else Expires header */
+
+   if (l && p[0] == '<')
+   {
+      while (i < l && p[i] != '>')
+         i++;
+   }
+
+   for (; i < l; i++)
+   {
+      if (   p[i] == ';' && l - i > 9
+          && !strncasecmp(p + i + 1, "expires=", 8)
+          && expires_value(p + i + 9, l - i - 9, &expires))
+      {
+         return expires;
+      }
+   }
+
+   if (   packet->expires.offs
+       && expires_value(packet->buf.p + packet->expires.offs,
+                        packet->expires.len, &expires))
+   {
+      return expires;
+   }
+
+   return REGISTER_DEFAULT_EXPIRES;
+}
+
+static void client_timeout(void *context)
+{
+   client_context_t *client = context;
+
+   if (client->connected)
+   {
+      log_printf(LOG_VERBOSE, "[%u] Registration expired - disconnecting",
+         client->id);
+
+      client_disconnect(client);
+   }
+}
+
+
+/* ------------------------------------------------------------------------
+   RTP peer address
+   ------------------------------------------------------------------------ */
+
+static int rtp_peer(client_context_t *client,
+                    const endpoint_t *from_ep, const endpoint_t *to_ep,
+                    const char *addr, int addr_l)
+{
+   /* not one of the SIP peers */
+
+   uint32_t in_addr;
+   int l;
+
+   if (   !addr_parse(addr, addr_l, &l, &in_addr)
+       || in_addr == from_ep->peer.in_addr
+       || in_addr == to_ep->peer.in_addr)
+   {
+      return 0;
+   }
+
+   memcpy(client->fon.rtp.addr, addr, addr_l);
+   client->fon.rtp.addr[addr_l] = '\0';
+   client->fon.rtp.addr_l = addr_l;
+   client->fon.rtp.in_addr = in_addr;
+
+   log_printf(LOG_VERBOSE, "[%u] %.*s%sRTP peer %.*s",
+      client->id,
+      from_ep->packet.method.len, from_ep->packet.buf.p,
+      from_ep->packet.method.len ? " " : "",
+      client->fon.rtp.addr_l, client->fon.rtp.addr);
+
+   client_plan(client);
+   return 1;
+}
+
 
 /* ------------------------------------------------------------------------
    process Fon to Box message
@@ -282,11 +590,18 @@ static int fon_to_box(client_context_t *client,
 {
    static const char log_prefix[] = "First Fon TCP message not recognized";
 
+   if (   from_ep->packet.method.len == 8
+       && !strncasecmp(from_ep->packet.buf.p, "REGISTER", 8))
+   {
+      timer_arm(&client->timer,
+         (register_expires(&from_ep->packet) + CLIENT_EXPIRES_GRACE) * 1000);
+   }
+
    while (client->contact_id == NULL)
    {
       /* TCP connection, first message */
 
-      int16_t contact_id_i, contact_id_l;
+      int contact_id_i, contact_id_l;
 
       assert(client->contact_id_l == 0);
 
@@ -335,6 +650,12 @@ static int fon_to_box(client_context_t *client,
             }
          }
 
+         if (cl == NULL)
+         {
+            client_disconnect_worker(client,
+               from_ep->packet.buf.p + contact_id_i, contact_id_l);
+         }
+
          contact_id = malloc(contact_id_l + 1);
          if (contact_id == NULL)
          {
@@ -354,6 +675,7 @@ static int fon_to_box(client_context_t *client,
 
          client->contact_id = contact_id;
          client->contact_id_l = contact_id_l;
+         client_contact_register(client);
 
          d.i += contact_id_l + 1;
          if (   (addr_i = addr_find(&d, &addr_l)) == d.i
@@ -367,6 +689,9 @@ static int fon_to_box(client_context_t *client,
             client->fon.contact.port[port_l] = '\0';
             client->fon.contact.port_l = port_l;
 
+            /* validated by addr_find() and port_find() */
+            addr_binary(&client->fon.contact);
+
             log_printf(LOG_VERBOSE, "[%u] %.*s Contact '%.*s' @%.*s:%.*s",
                client->id,
                from_ep->packet.method.len, from_ep->packet.buf.p,
@@ -374,6 +699,7 @@ static int fon_to_box(client_context_t *client,
                client->fon.contact.addr_l, client->fon.contact.addr,
                client->fon.contact.port_l, client->fon.contact.port);
 
+            client_plan(client);
             break;
          }
       }
@@ -383,82 +709,63 @@ static int fon_to_box(client_context_t *client,
       return 0;
    }
 
-   if (client->fon.contact.addr_l)
+   if (   client->fon.contact.addr_l == 0
+       && client->fon.rtp.addr_l == 0
+       && from_ep->packet.rewrite)
    {
-      /* TCP connection */
+      /* UDP connection, first SDP message, locate RTP peer address */
 
-      if (!modify_header(&from_ep->packet,
-                         &client->fon.contact, &to_ep->local))
-      {
-         log_printf(LOG_VERBOSE,
-            "Fon message header address modification failed");
-         return 0;
-      }
+      packet_t *packet = &from_ep->packet;
+      const packet_index_t *index = packet_index(packet);
+      data_t d;
+      int i;
 
-      if (!modify_data(&from_ep->packet,
-                       &client->fon.contact, &from_ep->peer))
-      {
-         log_printf(LOG_VERBOSE,
-            "Fon message data address modification failed");
-         return 0;
-      }
-   }
-   else if (from_ep->packet.data.len)
-   {
-      /* UDP connection */
+      d.p = packet->buf.p + packet->header.len;
+      d.i = 0;
+      d.l = packet->data.len;
 
-      if (client->fon.rtp.addr_l == 0)
+      for (i = 0; packet->sdp && i < index->sdp_fields; i++)
       {
-         /* first SDP message, locate RTP peer address */
+         /* c= connection address */
 
-         data_t d;
-
-         d.p = from_ep->packet.buf.p + from_ep->packet.header.len;
-         d.i = 0;
-         d.l = from_ep->packet.data.len;
+         const sdp_field_t *field = index->sdp_field + i;
 
-         for (;;)
+         if (   field->type == 'c' && field->addr.len
+             && rtp_peer(client, from_ep, to_ep,
+                         d.p + field->addr.offs, field->addr.len))
          {
-            int addr_i, addr_l;
-
-            if ((addr_i = addr_find(&d, &addr_l)) == -1)
-               break;
-
-            if (   (   addr_l == from_ep->peer.addr_l
-                    && !memcmp(d.p + addr_i, from_ep->peer.addr, addr_l))
-                || (   addr_l == to_ep->peer.addr_l
-                    && !memcmp(d.p + addr_i, to_ep->peer.addr, addr_l)))
-            {
-               d.i = addr_i + addr_l;
-               continue;
-            }
-
-            memcpy(client->fon.rtp.addr, d.p + addr_i, addr_l);
-            client->fon.rtp.addr[addr_l] = '\0';
-            client->fon.rtp.addr_l = addr_l;
-
-            log_printf(LOG_VERBOSE, "[%u] %.*s%sRTP peer %.*s",
-               client->id,
-               from_ep->packet.method.len, from_ep->packet.buf.p,
-               from_ep->packet.method.len ? " " : "",
-               client->fon.rtp.addr_l, client->fon.rtp.addr);
-
             break;
          }
       }
 
-      if (client->fon.rtp.addr_l)
+      while (!packet->sdp)
       {
-         if (!modify_data(&from_ep->packet,
-                          &client->fon.rtp, &from_ep->peer))
-         {
-            log_printf(LOG_VERBOSE,
-               "Fon message data address modification failed");
-            return 0;
-         }
+         int addr_i, addr_l;
+
+         if ((addr_i = addr_find(&d, &addr_l)) == -1)
+            break;
+
+         if (rtp_peer(client, from_ep, to_ep, d.p + addr_i, addr_l))
+            break;
+
+         d.i = addr_i + addr_l;
       }
    }
 
+   if (!modify_header(&from_ep->packet, &client->plan.fon_header))
+   {
+      log_printf(LOG_VERBOSE,
+         "Fon message header address modification failed");
+      return 0;
+   }
+
+   if (!modify_data(&from_ep->packet, &client->plan.fon_data))
+   {
+      log_printf(LOG_VERBOSE,
+         "Fon message data address modification failed");
+      return 0;
+   }
+
    return 1;
 }
 
@@ -477,37 +784,18 @@ static int box_to_fon(client_context_t *client,
       return 0;
    }
 
-   if (client->fon.contact.addr_l)
+   if (!modify_header(&from_ep->packet, &client->plan.box_header))
    {
-      /* TCP connection */
-
-      if (!modify_header(&from_ep->packet,
-                         &from_ep->local, &client->fon.contact))
-      {
-         log_printf(LOG_VERBOSE,
-            "Box message header address modification failed");
-         return 0;
-      }
-
-      if (!modify_data(&from_ep->packet,
-                       &to_ep->peer, &client->fon.contact))
-      {
-         log_printf(LOG_VERBOSE,
-            "Box message data address modification failed");
-         return 0;
-      }
+      log_printf(LOG_VERBOSE,
+         "Box message header address modification failed");
+      return 0;
    }
-   else if (client->fon.rtp.addr_l)
-   {
-      /* UDP connection */
 
-      if (!modify_data(&from_ep->packet,
-                       &to_ep->peer, &client->fon.rtp))
-      {
-         log_printf(LOG_VERBOSE,
-            "Box message data address modification failed");
-         return 0;
-      }
+   if (!modify_data(&from_ep->packet, &client->plan.box_data))
+   {
+      log_printf(LOG_VERBOSE,
+         "Box message data address modification failed");
+      return 0;
    }
 
    return 1;
@@ -520,10 +808,15 @@ static int box_to_fon(client_context_t *client,
 
 static void dump_packet(const char *from, const addr_t *from_addr,
                         const char *to, const addr_t *to_addr,
-                        const packet_t *packet, enum protocol_t protocol)
+                        const struct iovec *iov, int iov_n,
+                        enum protocol_t protocol)
 {
-   int i = 0, l = packet->header.len + packet->data.len, col = 0;
+   int i, col = 0, l = 0;
+
+   for (i = 0; i < iov_n; i++)
+      l += iov[i].iov_len;
 
+   flockfile(stdout);
    log_printf(LOG_DUMP, "%s %s%s%.*s:%.*s -> %s%s%.*s:%.*s Size %d",
       protocol == P_TCP ? "TCP" : "UDP",
       from ? from : "", from ? " " : "",
@@ -531,22 +824,27 @@ static void dump_packet(const char *from, const addr_t *from_addr,
       to ? to : "", to ? " " : "",
       to_addr->addr_l, to_addr->addr, to_addr->port_l, to_addr->port, l);
 
-   while (i < l)
+   for (; iov_n; iov++, iov_n--)
    {
-      char c = packet->buf.p[i++];
-      if (c == '\n')
+      const char *p = iov->iov_base;
+
+      for (i = 0; i < (int)iov->iov_len; i++)
       {
-         col = 0;
-         fputs("\\n\n", stdout);
-      }
-      else {
-         col++;
-         if (c == '\r')
-            fputs("\\r", stdout);
-         else if (c < 32 || c > 127)
-            fprintf(stdout, "\\x%02x", c);
-         else
-            fputc(c, stdout);
+         char c = p[i];
+         if (c == '\n')
+         {
+            col = 0;
+            fputs("\\n\n", stdout);
+         }
+         else {
+            col++;
+            if (c == '\r')
+               fputs("\\r", stdout);
+            else if (c < 32 || c > 127)
+               fprintf(stdout, "\\x%02x", c);
+            else
+               fputc(c, stdout);
+         }
       }
    }
 
@@ -554,6 +852,7 @@ static void dump_packet(const char *from, const addr_t *from_addr,
       fputc('\n', stdout);
 
    fflush(stdout);
+   funlockfile(stdout);
 }
 
 
@@ -561,11 +860,12 @@ static void dump_packet(const char *from, const addr_t *from_addr,
    process client socket event
    ------------------------------------------------------------------------ */
 
-static void client_packet(client_context_t *client,
-                          endpoint_t *from_ep, endpoint_t *to_ep)
+static int client_packet(client_context_t *client,
+                         endpoint_t *from_ep, endpoint_t *to_ep)
 {
    const char *from, *to;
-   int from_dump, to_dump, ok;
+   struct iovec *iov;
+   int from_dump, to_dump, iov_n, ok;
    enum protocol_t protocol;
    enum { D_FON_TO_BOX, D_BOX_TO_FON } direction;
 
@@ -623,10 +923,22 @@ static void client_packet(client_context_t *client,
    }
 
    if (from_dump)
+   {
+      struct iovec from_iov;
+
+      from_iov.iov_base = from_ep->packet.buf.p;
+      from_iov.iov_len =   from_ep->packet.header.len
+                         + from_ep->packet.data.len;
       dump_packet(from, &from_ep->peer, NULL, &from_ep->local,
-                  &from_ep->packet, protocol);
+                  &from_iov, 1, protocol);
+   }
 
-   if (direction == D_FON_TO_BOX)
+   if (from_ep->packet.header.len == 0)
+   {
+      /* streamed body part */
+      ok = 1;
+   }
+   else if (direction == D_FON_TO_BOX)
       ok = fon_to_box(client, from_ep, to_ep);
    else
       ok = box_to_fon(client, from_ep, to_ep);
@@ -640,7 +952,7 @@ static void client_packet(client_context_t *client,
          protocol == P_TCP ? "tcp" : "udp");
 
       client_disconnect(client);
-      return;
+      return 0;
    }
 
    if (!modify_content_length(&from_ep->packet))
@@ -653,15 +965,32 @@ static void client_packet(client_context_t *client,
          protocol == P_TCP ? "tcp" : "udp");
 
       client_disconnect(client);
-      return;
+      return 0;
+   }
+
+   /* unchanged spans sent from the packet buffer, datagrams are copied
+      by sfd_transmit() */
+
+   iov_n = packet_iov(&from_ep->packet, &iov);
+   if (iov_n == 0)
+   {
+      log_printf(LOG_VERBOSE, "[%u] Message to %.*s:%.*s/%s"
+         " could not be assembled - disconnecting",
+         client->id,
+         to_ep->peer.addr_l, to_ep->peer.addr,
+         to_ep->peer.port_l, to_ep->peer.port,
+         protocol == P_TCP ? "tcp" : "udp");
+
+      client_disconnect(client);
+      return 0;
    }
 
    if (to_dump)
       dump_packet(NULL, &to_ep->local, to, &to_ep->peer,
-                  &from_ep->packet, protocol);
+                  iov, iov_n, protocol);
 
-   if (!sfd_transmit(to_ep->sfd, from_ep->packet.buf.p,
-                     from_ep->packet.header.len + from_ep->packet.data.len))
+   ok = sfd_transmit(to_ep->sfd, iov, iov_n);
+   if (!ok)
    {
       log_printf(LOG_VERBOSE, "[%u]"
          " Failed to transmit to %.*s:%.*s/%s - disconnecting",
@@ -671,6 +1000,96 @@ static void client_packet(client_context_t *client,
          protocol == P_TCP ? "tcp" : "udp");
 
       client_disconnect(client);
+      return 0;
+   }
+
+   if (ok == 2)
+   {
+      /* output queue full, stop reading until SFD_EVENT_WRITE */
+
+      log_printf(LOG_DETAIL, "[%u]"
+         " Output to %.*s:%.*s/%s congested - pausing %s",
+         client->id,
+         to_ep->peer.addr_l, to_ep->peer.addr,
+         to_ep->peer.port_l, to_ep->peer.port,
+         protocol == P_TCP ? "tcp" : "udp", from);
+
+      from_ep->paused = 1;
+      sfd_pause(from_ep->sfd, 1);
+   }
+
+   return ok;
+}
+
+
+/* ------------------------------------------------------------------------
+   forward received messages
+   ------------------------------------------------------------------------ */
+
+#define CLIENT_RECEIVE_TCP    (4 * 1024)    /* TCP bytes read per event */
+#define CLIENT_PACKET_BUDGET  16            /* messages forwarded per event */
+
+static int client_next_packet(client_context_t *client, endpoint_t *from_ep,
+                              enum protocol_t protocol,
+                              const void *data_p, uint32_t data_l)
+{
+   if (!next_packet(&from_ep->packet, data_p, data_l))
+   {
+      log_printf(LOG_VERBOSE, "[%u]"
+         " Packet from %.*s:%.*s/%s not recognized - disconnecting",
+         client->id,
+         from_ep->peer.addr_l, from_ep->peer.addr,
+         from_ep->peer.port_l, from_ep->peer.port,
+         protocol == P_TCP ? "tcp" : "udp");
+
+      client_disconnect(client);
+      return 0;
+   }
+
+   return 1;
+}
+
+static int client_forward(client_context_t *client,
+                          endpoint_t *from_ep, endpoint_t *to_ep,
+                          enum protocol_t protocol)
+{
+   /* forward all complete messages received, pipelined messages left
+      when the budget is exhausted are forwarded with the next tick,
+      reading is paused until then */
+
+   int budget = CLIENT_PACKET_BUDGET;
+
+   while (from_ep->packet.status == PACKET_READY && !from_ep->paused)
+   {
+      if (budget-- == 0)
+      {
+         timer_arm(&client->drain, 0);
+         break;
+      }
+
+      if (   !client_packet(client, from_ep, to_ep)
+          || !client_next_packet(client, from_ep, protocol, NULL, 0))
+      {
+         /* disconnected */
+         return 0;
+      }
+   }
+
+   sfd_pause(from_ep->sfd,
+             from_ep->paused || from_ep->packet.status == PACKET_READY);
+   return 1;
+}
+
+static void client_drain(void *context)
+{
+   /* UDP datagrams carry a single message, left over on TCP only */
+
+   client_context_t *client = context;
+
+   if (   client->connected
+       && client_forward(client, &client->fon.tcp, &client->box.tcp, P_TCP))
+   {
+      client_forward(client, &client->box.tcp, &client->fon.tcp, P_TCP);
    }
 }
 
@@ -678,8 +1097,10 @@ void on_client_event(int sfd, void *context, int sfd_event)
 {
    client_context_t *client = context;
    endpoint_t *from_ep, *to_ep;
-   int available, ok;
+   uint32_t received;
    enum protocol_t protocol;
+   char *p;
+   int ok;
 
    if (!client->connected)
    {
@@ -715,31 +1136,58 @@ void on_client_event(int sfd, void *context, int sfd_event)
 
    assert(to_ep->sfd != -1);
 
-   if (   (sfd_event & ~SFD_EVENT_DATA)
-       || (available = sfd_available(from_ep->sfd)) == -1
-       || !buf_resize(&tmp_buf, available)
-       || (ok = sfd_receive(from_ep->sfd, tmp_buf.p, available)) == 2)
+   if (sfd_event & SFD_EVENT_WRITE)
    {
-      client_disconnect(client);
-      return;
+      /* output queue drained, resume reading from opposite endpoint */
+
+      to_ep->paused = 0;
+      if (!client_forward(client, to_ep, from_ep, protocol))
+         return;
+
+      sfd_event &= ~SFD_EVENT_WRITE;
+      if (sfd_event == 0)
+         return;
    }
-   if (!ok)
+
+   if (sfd_event & SFD_EVENT_ERROR)
    {
-      log_printf(LOG_VERBOSE, "[%u]"
-         " Failed to receive from %.*s:%.*s/%s - disconnecting",
-         client->id,
-         from_ep->peer.addr_l, from_ep->peer.addr,
-         from_ep->peer.port_l, from_ep->peer.port,
-         protocol == P_TCP ? "tcp" : "udp");
+      /* e.g. Box connect failed or timed out */
 
+      int err_no = sfd_error(from_ep->sfd);
+      if (err_no)
+      {
+         log_printf(LOG_VERBOSE, "[%u]"
+            " Connection to %.*s:%.*s/%s failed [%d] %s - disconnecting",
+            client->id,
+            from_ep->peer.addr_l, from_ep->peer.addr,
+            from_ep->peer.port_l, from_ep->peer.port,
+            protocol == P_TCP ? "tcp" : "udp",
+            err_no, strerror(err_no));
+      }
+   }
+
+   if (sfd_event & ~SFD_EVENT_DATA)
+   {
       client_disconnect(client);
       return;
    }
 
-   if (!next_packet(&from_ep->packet, tmp_buf.p, available))
+   /* paused while messages are left over */
+   assert(from_ep->packet.status != PACKET_READY);
+
+   /* receive into packet buffer, remaining TCP data with next event */
+
+   received = protocol == P_TCP ? CLIENT_RECEIVE_TCP : UDP_RECEIVE_MAX;
+   if (   (p = packet_buffer(&from_ep->packet, received)) == NULL
+       || (ok = sfd_receive(from_ep->sfd, p, &received)) == 2)
+   {
+      client_disconnect(client);
+      return;
+   }
+   if (!ok)
    {
       log_printf(LOG_VERBOSE, "[%u]"
-         " Packet from %.*s:%.*s/%s not recognized - disconnecting",
+         " Failed to receive from %.*s:%.*s/%s - disconnecting",
          client->id,
          from_ep->peer.addr_l, from_ep->peer.addr,
          from_ep->peer.port_l, from_ep->peer.port,
@@ -749,11 +1197,11 @@ void on_client_event(int sfd, void *context, int sfd_event)
       return;
    }
 
-   if (from_ep->packet.status == PACKET_INCOMPLETE)
-      return;
-
-   assert(from_ep->packet.status == PACKET_READY);
-   client_packet(client, from_ep, to_ep);
+   if (   received
+       && client_next_packet(client, from_ep, protocol, p, received))
+   {
+      client_forward(client, from_ep, to_ep, protocol);
+   }
 }
 
 
@@ -763,7 +1211,7 @@ void on_client_event(int sfd, void *context, int sfd_event)
 
 static void client_cleanup(void *context)
 {
-   client_context_t *client = context, **client_p;
+   client_context_t *client = context;
 
    assert(client->fon.tcp.sfd == -1);
    client->connected = 0;
@@ -787,25 +1235,21 @@ static void client_cleanup(void *context)
       return;
    }
 
-   client_p = &client_list;
-   while (*client_p != NULL)
-   {
-      if (*client_p == client)
-      {
-         *client_p = client->next;
-         break;
-      }
+   timer_cancel(&client->timer);
+   timer_cancel(&client->drain);
 
-      client_p = &(*client_p)->next;
-   }
+   if (client->prev_p)
+      client_list_remove(client);
+   if (client->contact_id)
+      contact_unregister(client->contact_id, client->contact_id_l, client->id);
 
    log_printf(LOG_DETAIL, "[%u] Disconnect", client->id);
 
-   buf_cleanup(&client->fon.tcp.buf);
-   buf_cleanup(&client->fon.udp.buf);
+   buf_cleanup(&client->fon.tcp.packet.buf);
+   buf_cleanup(&client->fon.udp.packet.buf);
 
-   buf_cleanup(&client->box.tcp.buf);
-   buf_cleanup(&client->box.udp.buf);
+   buf_cleanup(&client->box.tcp.packet.buf);
+   buf_cleanup(&client->box.udp.packet.buf);
 
    free(client->contact_id);
    free(client);
@@ -823,34 +1267,38 @@ void client_tcp_setup(int sfd)
       return;
    }
 
-   client->next = client_list;
-   client->id = ++client_id;
-   client_list = client;
+   client->id = client_id_next();
+   client_list_insert(client);
    client->connected = 1;
    client->fon.udp.sfd = client->box.tcp.sfd = client->box.udp.sfd = -1;
+   timer_init(&client->timer, client_timeout, client);
+   timer_init(&client->drain, client_drain, client);
 
-   if (   tcp_accept(&client->fon.tcp.sfd, sfd,
-               client->fon.tcp.peer.addr, &client->fon.tcp.peer.addr_l,
-               client->fon.tcp.peer.port, &client->fon.tcp.peer.port_l)
-       && sfd_local_addr(client->fon.tcp.sfd,
-               client->fon.tcp.local.addr, &client->fon.tcp.local.addr_l,
-               client->fon.tcp.local.port, &client->fon.tcp.local.port_l)
+   if (   tcp_accept(&client->fon.tcp.sfd, sfd, &client->fon.tcp.peer)
+       && sfd_local_addr(client->fon.tcp.sfd, &client->fon.tcp.local)
        && sfd_register(client->fon.tcp.sfd, client, client_cleanup))
    {
+      addr_text(&client->fon.tcp.peer);
+      addr_text(&client->fon.tcp.local);
+
       log_printf(LOG_DETAIL, "[%u] Connect %.*s:%.*s/tcp",
          client->id,
          client->fon.tcp.peer.addr_l, client->fon.tcp.peer.addr,
          client->fon.tcp.peer.port_l, client->fon.tcp.peer.port);
 
+      /* until the first REGISTER */
+      timer_arm(&client->timer,
+         (REGISTER_DEFAULT_EXPIRES + CLIENT_EXPIRES_GRACE) * 1000);
+
+      /* connect in progress, Fon messages are queued for the Box
+         until the connection is established */
+
       client->box.tcp.peer = options.box;
-      if (   tcp_connect(&client->box.tcp.sfd,
-                  client->box.tcp.peer.addr, client->box.tcp.peer.addr_l,
-                  client->box.tcp.peer.port, client->box.tcp.peer.port_l)
-          && sfd_local_addr(client->box.tcp.sfd,
-                  client->box.tcp.local.addr, &client->box.tcp.local.addr_l,
-                  client->box.tcp.local.port, &client->box.tcp.local.port_l)
+      if (   tcp_connect(&client->box.tcp.sfd, &client->box.tcp.peer)
+          && sfd_local_addr(client->box.tcp.sfd, &client->box.tcp.local)
           && sfd_register(client->box.tcp.sfd, client, client_cleanup))
       {
+         addr_text(&client->box.tcp.local);
          return;
       }
 
@@ -865,28 +1313,22 @@ void client_tcp_setup(int sfd)
    tcp_disconnect(&client->fon.tcp.sfd);
 }
 
-void client_udp_setup(int sfd)
+static void client_udp_packet(char *data, int data_l, int size,
+                              addr_t *peer, addr_t *local, int forwarded)
 {
+   /* data parsed in place, owned by the caller,
+      peer and local text rendered when used */
+
    client_context_t *client;
    packet_t packet;
-   addr_t peer, local;
-   int available;
-   int16_t contact_id_i, contact_id_l;
-
-   if (   (available = sfd_available(sfd)) == -1
-       || !buf_resize(&tmp_buf, available)
-       || (available = udp_receive(sfd, tmp_buf.p, available,
-               peer.addr, &peer.addr_l, peer.port, &peer.port_l,
-               local.addr, &local.addr_l, local.port, &local.port_l)) == -1)
-   {
-      return;
-   }
+   contact_t contact;
+   int contact_id_i, contact_id_l;
 
-   memset(&packet, 0, sizeof(packet));
-   if (!next_packet(&packet, tmp_buf.p, available))
+   if (!next_datagram(&packet, data, data_l, size))
    {
+      addr_text(peer);
       log_printf(LOG_VERBOSE, "Packet from %.*s:%.*s/udp not recognized",
-         peer.addr_l, peer.addr, peer.port_l, peer.port);
+         peer->addr_l, peer->addr, peer->port_l, peer->port);
 
       buf_cleanup(&packet.buf);
       return;
@@ -911,9 +1353,10 @@ void client_udp_setup(int sfd)
    }
    if (contact_id_i == -1)
    {
+      addr_text(peer);
       log_printf(LOG_VERBOSE, "Packet from %.*s:%.*s/udp not recognized,"
          " failed to decode %s header",
-         peer.addr_l, peer.addr, peer.port_l, peer.port,
+         peer->addr_l, peer->addr, peer->port_l, peer->port,
          packet.method.len ? "From" : "To");
 
       buf_cleanup(&packet.buf);
@@ -931,14 +1374,39 @@ void client_udp_setup(int sfd)
       }
    }
 
+   if (   client == NULL && !forwarded
+       && contact_lookup(packet.buf.p + contact_id_i, contact_id_l, &contact)
+       && contact.worker != worker_self())
+   {
+      /* contact handled by other worker, forward packet */
+
+      worker_msg_t *msg = malloc(sizeof(worker_msg_t) + data_l);
+      if (msg == NULL)
+      {
+         log_printf(LOG_ERROR, "client_udp_packet:"
+            " Memory allocation failed (%u bytes)",
+            (unsigned int)(sizeof(worker_msg_t) + data_l));
+      }
+      else {
+         msg->type = WORKER_MSG_UDP;
+         msg->client_id = contact.client_id;
+         msg->peer = *peer;
+         msg->local = *local;
+         msg->data_l = data_l;
+         memcpy(msg->data, data, data_l);
+         worker_post(contact.worker, msg);
+      }
+
+      buf_cleanup(&packet.buf);
+      return;
+   }
+
    if (packet.method.len == 8 && !strncasecmp(packet.buf.p, "REGISTER", 8))
    {
       if (   client
           && (   client->fon.udp.sfd == -1
-              || peer.addr_l != client->fon.udp.peer.addr_l
-              || memcmp(peer.addr, client->fon.udp.peer.addr, peer.addr_l)
-              || peer.port_l != client->fon.udp.peer.port_l
-              || memcmp(peer.port, client->fon.udp.peer.port, peer.port_l)))
+              || peer->in_addr != client->fon.udp.peer.in_addr
+              || peer->in_port != client->fon.udp.peer.in_port))
       {
          /* new registration, same contact, different address,
             disconnect if connected */
@@ -954,7 +1422,7 @@ void client_udp_setup(int sfd)
          client = calloc(1, sizeof(client_context_t));
          if (client == NULL)
          {
-            log_printf(LOG_ERROR, "client_udp_setup:"
+            log_printf(LOG_ERROR, "client_udp_packet:"
                " Memory allocation failed (%u bytes)",
                (unsigned int)sizeof(client_context_t));
 
@@ -962,14 +1430,16 @@ void client_udp_setup(int sfd)
             return;
          }
 
-         client->id = ++client_id;
+         client->id = client_id_next();
          client->fon.tcp.sfd = client->fon.udp.sfd =
          client->box.tcp.sfd = client->box.udp.sfd = -1;
+         timer_init(&client->timer, client_timeout, client);
+         timer_init(&client->drain, client_drain, client);
 
          client->contact_id = malloc(contact_id_l + 1);
          if (client->contact_id == NULL)
          {
-            log_printf(LOG_ERROR, "client_udp_setup:"
+            log_printf(LOG_ERROR, "client_udp_packet:"
                " Memory allocation failed (%d bytes)",
                contact_id_l + 1);
 
@@ -981,8 +1451,8 @@ void client_udp_setup(int sfd)
          client->contact_id[contact_id_l] = '\0';
          client->contact_id_l = contact_id_l;
 
-         client->next = client_list;
-         client_list = client;
+         client_list_insert(client);
+         client_contact_register(client);
       }
       else if (!client->connected)
       {
@@ -994,9 +1464,10 @@ void client_udp_setup(int sfd)
    else {
       if (client == NULL)
       {
+         addr_text(peer);
          log_printf(LOG_VERBOSE, "Packet from %.*s:%.*s/udp ignored,"
             " contact '%.*s' not found",
-            peer.addr_l, peer.addr, peer.port_l, peer.port,
+            peer->addr_l, peer->addr, peer->port_l, peer->port,
             contact_id_l, packet.buf.p + contact_id_i);
 
          buf_cleanup(&packet.buf);
@@ -1013,9 +1484,10 @@ void client_udp_setup(int sfd)
 
    if (client->fon.udp.sfd != -1)
    {
+      addr_text(peer);
       log_printf(LOG_VERBOSE, "Packet from %.*s:%.*s/udp ignored,"
          " contact '%.*s' already connected",
-         peer.addr_l, peer.addr, peer.port_l, peer.port,
+         peer->addr_l, peer->addr, peer->port_l, peer->port,
          contact_id_l, packet.buf.p + contact_id_i);
 
       buf_cleanup(&packet.buf);
@@ -1024,25 +1496,23 @@ void client_udp_setup(int sfd)
 
    assert(client->box.udp.sfd == -1);
 
-   client->fon.udp.peer = peer;
-   client->fon.udp.local = local;
+   client->fon.udp.peer = *peer;
+   client->fon.udp.local = *local;
+   addr_text(&client->fon.udp.peer);
+   addr_text(&client->fon.udp.local);
+
    if (   udp_connect(&client->fon.udp.sfd,
-               client->fon.udp.peer.addr, client->fon.udp.peer.addr_l,
-               client->fon.udp.peer.port, client->fon.udp.peer.port_l,
-               client->fon.udp.local.addr, client->fon.udp.local.addr_l,
-               client->fon.udp.local.port, client->fon.udp.local.port_l)
+               &client->fon.udp.peer, &client->fon.udp.local)
        && sfd_register(client->fon.udp.sfd, client, client_cleanup))
    {
       client->box.udp.peer = options.box;
-      if (   udp_connect(&client->box.udp.sfd,
-                  client->box.udp.peer.addr, client->box.udp.peer.addr_l,
-                  client->box.udp.peer.port, client->box.udp.peer.port_l,
-                  NULL, 0, NULL, 0)
-          && sfd_local_addr(client->box.udp.sfd,
-                  client->box.udp.local.addr, &client->box.udp.local.addr_l,
-                  client->box.udp.local.port, &client->box.udp.local.port_l)
+      client->box.udp.packet.datagram = 1;
+      if (   udp_connect(&client->box.udp.sfd, &client->box.udp.peer, NULL)
+          && sfd_local_addr(client->box.udp.sfd, &client->box.udp.local)
           && sfd_register(client->box.udp.sfd, client, client_cleanup))
       {
+         addr_text(&client->box.udp.local);
+
          if (!client->connected)
          {
             client->connected = 1;
@@ -1065,7 +1535,14 @@ void client_udp_setup(int sfd)
          }
 
          client->fon.udp.packet = packet;
-         client_packet(client, &client->fon.udp, &client->box.udp);
+         /* receive buffer reused, copy a message left over */
+
+         if (   client_forward(client, &client->fon.udp, &client->box.udp,
+                               P_UDP)
+             && !buf_own(&client->fon.udp.packet.buf))
+         {
+            client_disconnect(client);
+         }
          return;
       }
 
@@ -1081,3 +1558,75 @@ void client_udp_setup(int sfd)
    buf_cleanup(&packet.buf);
    client_disconnect(client);
 }
+
+void client_udp_setup(int sfd)
+{
+   int i, cnt;
+
+   if (udp_data == NULL)
+   {
+      udp_data = malloc(UDP_RECEIVE_BATCH * UDP_RECEIVE_MAX);
+      if (udp_data == NULL)
+      {
+         log_printf(LOG_ERROR, "client_udp_setup:"
+            " Memory allocation failed (%u bytes)",
+            (unsigned int)(UDP_RECEIVE_BATCH * UDP_RECEIVE_MAX));
+         return;
+      }
+
+      for (i = 0; i < UDP_RECEIVE_BATCH; i++)
+         udp_dgram[i].data = udp_data + i * UDP_RECEIVE_MAX;
+   }
+
+   if (   udp_local.in_port == 0
+       && !sfd_local_addr(sfd, &udp_local))
+   {
+      return;
+   }
+
+   if ((cnt = udp_receive(sfd, udp_dgram, UDP_RECEIVE_BATCH)) == -1)
+      return;
+
+   for (i = 0; i < cnt; i++)
+   {
+      udp_dgram_t *dgram = udp_dgram + i;
+
+      if (dgram->data_l == -1)
+         continue;
+
+      dgram->local.in_port = udp_local.in_port;
+
+      client_udp_packet(dgram->data, dgram->data_l, UDP_RECEIVE_MAX,
+                        &dgram->peer, &dgram->local, 0);
+   }
+}
+
+
+/* ------------------------------------------------------------------------
+   process message from other worker
+   ------------------------------------------------------------------------ */
+
+void client_worker_msg(worker_msg_t *msg)
+{
+   client_context_t *client;
+
+   switch (msg->type)
+   {
+      case WORKER_MSG_UDP:
+         client_udp_packet(msg->data, msg->data_l, msg->data_l,
+                           &msg->peer, &msg->local, 1);
+         break;
+
+      case WORKER_MSG_DISCONNECT:
+         for (client = client_list; client != NULL; client = client->next)
+         {
+            if (client->id == msg->client_id)
+            {
+               if (client->connected)
+                  client_disconnect(client);
+               break;
+            }
+         }
+         break;
+   }
+}
@@ -34,6 +34,16 @@
 
 #define DEFAULT_SIP_PORT "5060"
 #define DEFAULT_LOG_LEVEL 0
+#define DEFAULT_MAX_MESSAGE (64 * 1024)
+#define MIN_MAX_MESSAGE 1024
+#define MAX_MAX_MESSAGE (16 * 1024 * 1024)
+#define DEFAULT_BODY_TYPE "application/sdp"
+
+#if defined(USE_POLL)
+#define ENGINE_DEFAULT_NAME "poll"
+#else
+#define ENGINE_DEFAULT_NAME "epoll"
+#endif
 
 options_t options;
 
@@ -42,7 +52,7 @@ options_t options;
    usage, parse command line
    ------------------------------------------------------------------------ */
 
-static const char short_opt[] = "hp:t:u:v::l:D:V";
+static const char short_opt[] = "hp:t:u:v::l:D:E:w:m:b:V";
 static struct option long_opt[] = {
    { "help",     no_argument,       0, 'h' },
    { "port",     required_argument, 0, 'p' },
@@ -51,6 +61,10 @@ static struct option long_opt[] = {
    { "verbose",  optional_argument, 0, 'v' },
    { "logfile",  required_argument, 0, 'l' },
    { "dump",     required_argument, 0, 'D' },
+   { "engine",   required_argument, 0, 'E' },
+   { "workers",  required_argument, 0, 'w' },
+   { "max-message", required_argument, 0, 'm' },
+   { "body-type", required_argument, 0, 'b' },
    { "version",  no_argument,       0, 'V' },
    { NULL }
 };
@@ -71,16 +85,30 @@ static void usage(void)
       "  -l LOGFILE    --logfile=LOGFILE  Log file or - (stdout)"
                                                  ", default: stderr\n"
       "  -D {FON|BOX}  --dump={FON|BOX}   Dump FON/BOX messages to stdout\n"
+      "  -E ENGINE     --engine=ENGINE    Event engine " ENGINE_DEFAULT_NAME
+#if defined(HAVE_IO_URING)
+                                                  " or io_uring"
+#endif
+                                                  ", default: "
+                                                  ENGINE_DEFAULT_NAME "\n"
+      "  -w N          --workers=N        Worker threads, default: 1\n"
+      "  -m N          --max-message=N    Message size limit in bytes"
+                                                 ", default: %u\n"
+      "                                   larger bodies are streamed if not\n"
+      "                                   rewritten, else rejected\n"
+      "  -b TYPE       --body-type=TYPE   Also rewrite bodies of TYPE"
+                                                 ", repeatable\n"
+      "                                   default: " DEFAULT_BODY_TYPE " only\n"
       "  -V            --version          Version information\n"
 
-      , options.pname);
+      , options.pname, DEFAULT_MAX_MESSAGE);
 
    exit(3);
 }
 
 static void parse_commandline(int argc, char *argv[])
 {
-   int opt, err = 0;
+   int opt, err = 0, i;
 
    options.pname = strrchr(argv[0], '/');
    if (options.pname)
@@ -90,6 +118,9 @@ static void parse_commandline(int argc, char *argv[])
 
    options.log_fp = stderr;
    options.log_level = DEFAULT_LOG_LEVEL;
+   options.workers = 1;
+   options.max_message = DEFAULT_MAX_MESSAGE;
+   options.body_type[options.body_types++] = DEFAULT_BODY_TYPE;
 
    while ((opt = getopt_long(argc, argv, short_opt, long_opt, NULL)) != -1)
    {
@@ -194,6 +225,67 @@ static void parse_commandline(int argc, char *argv[])
             }
             break;
 
+         case 'E':
+            if (!strcasecmp(ENGINE_DEFAULT_NAME, optarg))
+               options.engine = ENGINE_DEFAULT;
+#if defined(HAVE_IO_URING)
+            else if (!strcasecmp("io_uring", optarg))
+               options.engine = ENGINE_IO_URING;
+#endif
+            else {
+               fprintf(stderr, "Invalid event engine '%s'\n", optarg);
+               err++;
+            }
+            break;
+
+         case 'w':
+         {
+            char *end_p;
+            long int workers;
+
+            errno = 0;
+            workers = strtol(optarg, &end_p, 10);
+            if (   errno == 0 && *optarg && *end_p == '\0'
+                && workers > 0 && workers <= MAX_WORKERS)
+            {
+               options.workers = workers;
+            }
+            else {
+               fprintf(stderr, "Invalid number of workers '%s'\n", optarg);
+               err++;
+            }
+            break;
+         }
+
+         case 'm':
+         {
+            char *end_p;
+            long int max_message;
+
+            errno = 0;
+            max_message = strtol(optarg, &end_p, 10);
+            if (   errno == 0 && *optarg && *end_p == '\0'
+                && max_message >= MIN_MAX_MESSAGE
+                && max_message <= MAX_MAX_MESSAGE)
+            {
+               options.max_message = max_message;
+            }
+            else {
+               fprintf(stderr, "Invalid message size limit '%s'\n", optarg);
+               err++;
+            }
+            break;
+         }
+
+         case 'b':
+            if (options.body_types < BODY_TYPES_MAX)
+               options.body_type[options.body_types++] = optarg;
+            else {
+               fprintf(stderr, "Too many body types '%s'\n", optarg);
+               err++;
+            }
+            break;
+
          case 'V':
             printf("%s version %s\n", options.pname, VERSION_STRING);
             exit(2);
@@ -260,6 +352,9 @@ static void parse_commandline(int argc, char *argv[])
       usage();
    }
 
+   /* validated above, connections use the binary form */
+   addr_binary(&options.box);
+
    log_printf(LOG_VERBOSE, "Box address %.*s:%.*s",
       options.box.addr_l, options.box.addr,
       options.box.port_l, options.box.port);
@@ -271,6 +366,12 @@ static void parse_commandline(int argc, char *argv[])
 
    log_printf(LOG_VERBOSE, "TCP: Server SIP port %s", options.tcp_port);
    log_printf(LOG_VERBOSE, "UDP: Server SIP port %s", options.udp_port);
+   log_printf(LOG_VERBOSE, "Event engine %s",
+      options.engine == ENGINE_IO_URING ? "io_uring" : ENGINE_DEFAULT_NAME);
+   log_printf(LOG_VERBOSE, "Workers %d", options.workers);
+   log_printf(LOG_VERBOSE, "Message size limit %u bytes", options.max_message);
+   for (i = 0; i < options.body_types; i++)
+      log_printf(LOG_VERBOSE, "Body type %s", options.body_type[i]);
 }
 
 
@@ -280,7 +381,9 @@ static void parse_commandline(int argc, char *argv[])
 
 void client_tcp_setup(int sfd);
 void client_udp_setup(int sfd);
-static int sfd_server_tcp = -1, sfd_server_udp = -1;
+void client_worker_msg(worker_msg_t *msg);
+static __thread int sfd_server_tcp = -1, sfd_server_udp = -1;
+static __thread int server_failed;
 
 static void on_tcp_server_event(int sfd, int sfd_event)
 {
@@ -289,9 +392,10 @@ static void on_tcp_server_event(int sfd, int sfd_event)
       log_printf(LOG_ERROR, "TCP server socket no longer available"
          " - shutting down");
 
-      sfd_close(&sfd_server_udp);
-      sfd_close(&sfd_server_tcp);
-      exit(1);
+      /* closed by run_worker() */
+      server_failed = 1;
+      worker_stop();
+      return;
    }
 
    client_tcp_setup(sfd);
@@ -304,9 +408,10 @@ static void on_udp_server_event(int sfd, int sfd_event)
       log_printf(LOG_ERROR, "UDP server socket no longer available"
          " - shutting down");
 
-      sfd_close(&sfd_server_udp);
-      sfd_close(&sfd_server_tcp);
-      exit(1);
+      /* closed by run_worker() */
+      server_failed = 1;
+      worker_stop();
+      return;
    }
 
    client_udp_setup(sfd);
@@ -323,6 +428,8 @@ static void on_event(int sfd, void *context, int sfd_event)
 {
    if (context)
       on_client_event(sfd, context, sfd_event);
+   else if (sfd == worker_inbox_sfd())
+      worker_inbox_event(sfd, client_worker_msg);
    else if (sfd == sfd_server_tcp)
       on_tcp_server_event(sfd, sfd_event);
    else {
@@ -336,23 +443,48 @@ static void on_event(int sfd, void *context, int sfd_event)
    setup server sockets
    ------------------------------------------------------------------------ */
 
-static void server_setup(void)
+static int server_setup(void)
 {
    if (   tcp_listen(&sfd_server_tcp, NULL, 0,
                      options.tcp_port, strlen(options.tcp_port))
        && sfd_register(sfd_server_tcp, NULL, NULL)
        && udp_bind(&sfd_server_udp, NULL, 0,
                    options.udp_port, strlen(options.udp_port))
-       && sfd_register(sfd_server_udp, NULL, NULL))
+       && sfd_register(sfd_server_udp, NULL, NULL)
+       && sfd_register(worker_inbox_sfd(), NULL, NULL))
    {
-      return;
+      return 1;
    }
 
    log_printf(LOG_ERROR, "Server initialization failed");
 
    sfd_close(&sfd_server_udp);
    sfd_close(&sfd_server_tcp);
-   exit(1);
+   return 0;
+}
+
+
+/* ------------------------------------------------------------------------
+   worker event loop
+   ------------------------------------------------------------------------ */
+
+static int run_worker(int worker)
+{
+   int ok;
+
+   if (!server_setup())
+      return 0;
+
+   log_printf(LOG_VERBOSE, "Worker %d started", worker);
+
+   while ((ok = sfd_wait(on_event)) && !worker_stopped())
+      ;
+
+   sfd_close(&sfd_server_udp);
+   sfd_close(&sfd_server_tcp);
+
+   log_printf(LOG_VERBOSE, "Worker %d stopped", worker);
+   return ok && !server_failed;
 }
 
 
@@ -418,15 +550,15 @@ int main(int argc, char *argv[])
    log_printf(LOG_INFO, "Start %s version %s",
       options.pname, VERSION_STRING);
 
-   server_setup();
-   while (sfd_wait(on_event))
-      ;
+   if (!worker_run(run_worker))
+   {
+      log_printf(LOG_ERROR, "Exit %s version %s on worker failure",
+         options.pname, VERSION_STRING);
+      exit(1);
+   }
 
    log_printf(LOG_INFO, "Exit %s version %s",
       options.pname, VERSION_STRING);
-
-   sfd_close(&sfd_server_udp);
-   sfd_close(&sfd_server_tcp);
    return 0;
 }
 
@@ -454,6 +586,7 @@ void log_printf(enum loglevel_t level, const char *fmt, ...)
    localtime_r(&tv, &tm);
    strftime(tmp, sizeof(tmp), "%Y%m%d %H%M%S", &tm);
 
+   flockfile(fp);
    if (level == LOG_DUMP)
       fprintf(fp, "%s ", tmp + 2);
    else
@@ -465,6 +598,7 @@ void log_printf(enum loglevel_t level, const char *fmt, ...)
 
    fputc('\n', fp);
    fflush(fp);
+   funlockfile(fp);
 }
 
 void log_dump(enum loglevel_t level, const void *bufp, uint32_t len)
@@ -475,6 +609,7 @@ void log_dump(enum loglevel_t level, const void *bufp, uint32_t len)
       const unsigned char *p = (const unsigned char *)bufp;
       u_int32_t i, j;
 
+      flockfile(fp);
       for(i = 0; i < len; i += 16)
       {
          fprintf(fp, "%03x:", i);
@@ -492,6 +627,7 @@ void log_dump(enum loglevel_t level, const void *bufp, uint32_t len)
             fputc(' ', fp);
          fputs("|\n", fp);
       }
+      funlockfile(fp);
    }
 }
 
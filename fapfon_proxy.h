@@ -30,6 +30,11 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && !defined(NO_IO_URING)
+#define HAVE_IO_URING
+#endif
 
 
 /* ------------------------------------------------------------------------
@@ -38,6 +43,10 @@
 
 typedef struct
 {
+   uint32_t in_addr;             /* network byte order */
+   uint16_t in_port;             /* network byte order, 0: none */
+
+   /* text form, rendered by addr_text(), len 0: not rendered */
    char addr[16], port[6];
    uint8_t addr_l, port_l;
 }
@@ -62,6 +71,14 @@ enum loglevel_t
 #define LOG_DUMP_FON 1
 #define LOG_DUMP_BOX 2
 
+enum engine_t
+{
+   ENGINE_DEFAULT,               /* epoll, poll() if built with POLL=1 */
+   ENGINE_IO_URING
+};
+
+#define BODY_TYPES_MAX 8
+
 typedef struct
 {
    char *pname;                  /* process name */
@@ -71,6 +88,12 @@ typedef struct
    FILE *log_fp;                 /* log file descriptor */
    enum loglevel_t log_level;    /* log level */
    int log_dump;                 /* LOG_DUMP_FON and/or LOG_DUMP_BOX */
+   enum engine_t engine;         /* event engine */
+   int workers;                  /* worker threads */
+   uint32_t max_message;         /* message size limit, larger bodies not
+                                    rewritten are streamed */
+   const char *body_type[BODY_TYPES_MAX]; /* rewritten body content types */
+   int body_types;
 }
 options_t;
 
@@ -83,13 +106,16 @@ extern options_t options;
 
 typedef struct
 {
-   char *p;
-   uint16_t allocated, used;
+   char *p;                      /* offs bytes into the allocation */
+   uint32_t allocated, used;     /* counted from p */
+   uint32_t offs;                /* consumed, compacted when needed */
+   uint8_t external;             /* p not owned, copied on resize */
 }
 buf_t;
 
 void buf_cleanup(buf_t *buf);
 int buf_resize(buf_t *buf, uint32_t size);
+int buf_own(buf_t *buf);
 
 
 /* ------------------------------------------------------------------------
@@ -104,8 +130,48 @@ enum packet_status_t
    PACKET_READY
 };
 
-typedef struct { int16_t len; } len_t;
-typedef struct { int16_t offs, len; } loc_t;
+typedef struct { int32_t len; } len_t;
+typedef struct { int32_t offs, len; } loc_t;
+
+enum header_t
+{
+   HEADER_OTHER,
+   HEADER_VIA,
+   HEADER_FROM,
+   HEADER_TO,
+   HEADER_CONTACT,
+   HEADER_EXPIRES,
+   HEADER_CONTENT_LENGTH,
+   HEADER_CALL_ID,
+   HEADER_CSEQ,
+   HEADER_CONTENT_TYPE
+};
+
+#define PACKET_HEADERS 64            /* header index allocation increment */
+#define SDP_FIELDS 32                /* SDP field index allocation increment */
+#define PACKET_SPLICES 64            /* splice list allocation increment */
+
+typedef struct
+{
+   uint8_t id;                   /* enum header_t */
+   loc_t line, value;
+}
+header_index_t;
+
+typedef struct
+{
+   char type;                    /* SDP line type 'o', 'c', 'm' or 'a' */
+   loc_t addr, port;             /* relative to body, len 0: not present */
+}
+sdp_field_t;
+
+typedef struct
+{
+   uint32_t offs, len;           /* replaced range of the message */
+   uint8_t with_l;
+   char with[16];                /* address, port or Content-Length */
+}
+splice_t;
 
 typedef struct
 {
@@ -115,12 +181,60 @@ typedef struct
    len_t header, data;
    len_t method;
 
+   /* message exceeding options.max_message, body not rewritten:
+      forwarded as received, following body parts have header.len 0 */
+   int streamed;
+   uint32_t stream;              /* body bytes still to come */
+   int datagram;                 /* UDP, not streamed */
+
    loc_t current_line;
-   loc_t via_line, via, from, to, contact, content_length;
+   loc_t via_line, via, from, to, contact, content_length, expires;
+   loc_t content_type;
+
+   /* body content type in options.body_type, other bodies are
+      forwarded without scanning */
+   int rewrite;
+   int sdp;                      /* application/sdp body, indexed */
+
+   /* top Via parameters, offs 0: not present */
+   loc_t via_rport, via_branch, via_received;
+
+   uint32_t cseq;
+   loc_t cseq_method;
+
+   uint32_t index_seq;           /* packet_index_t owner, 0: none */
 }
 packet_t;
 
+/* per-message indices, one scratch area per worker, held by the packet
+   last parsed or modified, rebuilt by packet_index() for another one */
+typedef struct
+{
+   uint32_t seq;
+
+   /* all header lines in order */
+   uint32_t headers, headers_allocated;
+   header_index_t *header_index;
+
+   /* SDP address and port fields of o=, c=, m=, a=rtcp and a=candidate
+      lines in order */
+   uint32_t sdp_fields, sdp_fields_allocated;
+   sdp_field_t *sdp_field;
+
+   /* modifications, applied by packet_iov() */
+   uint32_t splices, splices_allocated;
+   splice_t *splice;
+
+   /* packet_iov() output */
+   struct iovec *iov;
+   uint32_t iov_allocated;
+}
+packet_index_t;
+
+char *packet_buffer(packet_t *packet, uint32_t size);
 int next_packet(packet_t *packet, const void *next_data, uint32_t next_size);
+int next_datagram(packet_t *packet, char *data, uint32_t data_l, uint32_t size);
+packet_index_t *packet_index(packet_t *packet);
 
 
 /* ------------------------------------------------------------------------
@@ -130,18 +244,51 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size);
 typedef struct
 {
    char *p;
-   uint16_t i, l;
+   uint32_t i, l;
 }
 data_t;
 
-int data_modify(packet_t *packet, data_t *data,
+int data_splice(packet_t *packet, const data_t *data,
                 int replace_i, int replace_l,
                 const char *with, int with_l);
+int packet_iov(packet_t *packet, struct iovec **iov_p);
+
+typedef struct
+{
+   uint32_t i, l;                /* address position in data */
+   uint32_t addr;                /* network byte order */
+}
+addr_pos_t;
+
+#define ADDR_SCAN_MAX 16
 
 int addr_find(const data_t *data, int *addr_l_p);
+int addr_scan(const data_t *data, addr_pos_t *pos, int pos_max);
 int port_find(const data_t *data, int addr_i, int addr_l, int *port_l_p);
 
 
+/* ------------------------------------------------------------------------
+   timers
+   ------------------------------------------------------------------------ */
+
+typedef void (*timer_cb_t)(void *context);
+
+typedef struct timer_item
+{
+   struct timer_item *next, **prev_p;   /* prev_p NULL: not armed */
+   uint32_t expires;                    /* tick */
+   timer_cb_t cb;
+   void *context;
+}
+timer_item_t;
+
+void timer_init(timer_item_t *timer, timer_cb_t cb, void *context);
+void timer_arm(timer_item_t *timer, uint32_t timeout_ms);
+void timer_cancel(timer_item_t *timer);
+int timer_timeout(void);
+void timer_run(void);
+
+
 /* ------------------------------------------------------------------------
    network
    ------------------------------------------------------------------------ */
@@ -152,6 +299,10 @@ typedef void (*sfd_cleanup_t)(void *context);
 #define SFD_EVENT_DATA    1
 #define SFD_EVENT_ERROR   2
 #define SFD_EVENT_HANGUP  4
+#define SFD_EVENT_WRITE   8      /* output queue below low-water mark */
+
+#define SFD_QUEUE_HIGH_WATER  (64 * 1024)   /* sfd_transmit() returns 2 */
+#define SFD_QUEUE_LOW_WATER   (16 * 1024)
 
 int sfd_wait(sfd_callback_t cb);
 int sfd_register(int sfd, void *context, sfd_cleanup_t cleanup);
@@ -162,31 +313,44 @@ int udp_bind(int *sfd_p, const char *addr, uint8_t addr_l,
                          const char *port, uint8_t port_l);
 void sfd_close(int *sfd_p);
 
-int tcp_accept(int *sfd_p, int listen_sfd,
-               char *peer_addr, uint8_t *peer_addr_l_p,
-               char *peer_port, uint8_t *peer_port_l_p);
-int tcp_connect(int *sfd_p, const char *addr, uint8_t addr_l,
-                            const char *port, uint8_t port_l);
+int tcp_accept(int *sfd_p, int listen_sfd, addr_t *peer);
+int tcp_connect(int *sfd_p, const addr_t *addr);
 void tcp_disconnect(int *sfd_p);
 
-int udp_connect(int *sfd_p, const char *addr, uint8_t addr_l,
-                            const char *port, uint8_t port_l,
-                const char *source_addr, uint8_t source_addr_l,
-                const char *source_port, uint8_t source_port_l);
+int udp_connect(int *sfd_p, const addr_t *addr, const addr_t *source);
 void udp_disconnect(int *sfd_p);
 
-int sfd_local_addr(int sfd, char *local_addr, uint8_t *local_addr_l_p,
-                            char *local_port, uint8_t *local_port_l_p);
+int sfd_local_addr(int sfd, addr_t *local);
+int sfd_error(int sfd);
+
+int sfd_transmit(int sfd, struct iovec *iov, int iov_n);
+void sfd_pause(int sfd, int pause);
+int sfd_receive(int sfd, void *data_p, uint32_t *data_l_p);
+
+#define UDP_RECEIVE_BATCH  16             /* datagrams per udp_receive() */
+#define UDP_RECEIVE_MAX    (16 * 1024)    /* larger datagrams are dropped */
+
+typedef struct
+{
+   char *data;                   /* UDP_RECEIVE_MAX bytes */
+   int data_l;                   /* -1: truncated */
+   addr_t peer, local;           /* text not rendered, local address
+                                    only, no port */
+}
+udp_dgram_t;
+
+int udp_receive(int sfd, udp_dgram_t *dgram, int n);
 
-int sfd_transmit(int sfd, const void *data_p, uint16_t data_l);
-int sfd_receive(int sfd, void *data_p, uint16_t data_l);
-int udp_receive(int sfd, void *data_p, uint16_t data_l,
-                char *peer_addr, uint8_t *peer_addr_l_p,
-                char *peer_port, uint8_t *peer_port_l_p,
-                char *local_addr, uint8_t *local_addr_l_p,
-                char *local_port, uint8_t *local_port_l_p);
-int sfd_available(int sfd);
+/* character classes */
+#define CHAR_DIGIT 0x01
+#define CHAR_DOT   0x02
+#define CHAR_COLON 0x04
 
+extern const uint8_t char_class[256];
+
+#define is_digit(c) (char_class[(uint8_t)(c)] & CHAR_DIGIT)
+
+int addr_parse(const char *p, int l, int *l_p, uint32_t *addr_p);
 int is_addr(const char *p, int l, int *l_p);
 void addr_ntoa(char *to, uint8_t *l_p, uint32_t addr);
 int addr_aton(uint32_t *addr_p, const char *addr, uint8_t addr_l);
@@ -195,6 +359,75 @@ int is_port(const char *p, int l, int *l_p);
 void port_ntoa(char *to, uint8_t *l_p, uint16_t port);
 int port_aton(uint16_t *port_p, const char *port, uint8_t port_l);
 
+void addr_set(addr_t *a, uint32_t addr, uint16_t port);
+void addr_text(addr_t *a);
+int addr_binary(addr_t *a);
+
+
+/* ------------------------------------------------------------------------
+   workers, contact registry
+   ------------------------------------------------------------------------ */
+
+#define MAX_WORKERS 64
+
+typedef struct
+{
+   int worker;                   /* owning worker */
+   uint32_t client_id;
+}
+contact_t;
+
+int contact_lookup(const char *id, int id_l, contact_t *contact);
+int contact_register(const char *id, int id_l, const contact_t *contact);
+void contact_unregister(const char *id, int id_l, uint32_t client_id);
+
+enum worker_msg_type_t
+{
+   WORKER_MSG_UDP,               /* UDP datagram received by other worker */
+   WORKER_MSG_DISCONNECT         /* disconnect stale client */
+};
+
+typedef struct worker_msg
+{
+   struct worker_msg *next;
+   enum worker_msg_type_t type;
+   uint32_t client_id;
+   addr_t peer, local;
+   uint32_t data_l;
+   char data[];
+}
+worker_msg_t;
+
+typedef int (*worker_main_t)(int worker);   /* 0: failed */
+typedef void (*worker_msg_cb_t)(worker_msg_t *msg);
+
+int worker_run(worker_main_t main_fn);
+void worker_stop(void);
+int worker_stopped(void);
+int worker_self(void);
+int worker_inbox_sfd(void);
+int worker_post(int to_worker, worker_msg_t *msg);
+void worker_inbox_event(int sfd, worker_msg_cb_t cb);
+
+
+/* ------------------------------------------------------------------------
+   io_uring event engine
+   ------------------------------------------------------------------------ */
+
+#if defined(HAVE_IO_URING)
+
+int uring_init(void);
+int uring_wait(sfd_callback_t cb, int timeout);
+int uring_register(int sfd, void *context);
+void uring_unregister(int sfd);
+
+int uring_accept(int listen_sfd);
+int uring_receive(int sfd, void *data_p, uint32_t *data_l_p);
+int uring_transmit(int sfd, const struct iovec *iov, int iov_n);
+void uring_pause(int sfd, int pause);
+
+#endif
+
 
 /* ------------------------------------------------------------------------
    logging
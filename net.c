@@ -24,61 +24,430 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
+#include <limits.h>
+#if defined(USE_POLL)
 #include <poll.h>
+#else
+#include <sys/epoll.h>
+#endif
 #include <assert.h>
 #include <errno.h>
 
 
 /* ------------------------------------------------------------------------
    socket event management
+
+   Default backend is epoll, registrations are kept in the kernel and
+   the socket is handed back through epoll_event.data. Build with
+   POLL=1 (USE_POLL) to fall back to poll().
+
+   With --engine=io_uring, events are processed by uring.c.
+
+   Poll items are kept in a table indexed by socket descriptor. Each
+   registration gets a new generation number, events pending on a
+   socket unregistered by a previous callback are recognized and ignored.
+
+   Sockets are non-blocking. Data which cannot be sent immediately is
+   copied into a queue per socket and flushed when the socket becomes
+   writable. Datagrams are always copied, the receive buffer and the
+   splice list they are built from are reused for the next message,
+   and queued during an event loop iteration to be sent with sendmmsg()
+   at its end.
    ------------------------------------------------------------------------ */
 
-typedef struct poll_item
+typedef struct sfd_out
+{
+   struct sfd_out *next;
+   uint32_t offs, len;
+   char data[];
+}
+sfd_out_t;
+
+typedef struct
 {
-   struct poll_item *next;
-   int sfd;
    void *context;
    sfd_cleanup_t cleanup;
+   uint32_t generation;
+   int registered;
+   int paused;                   /* reads paused */
+   sfd_out_t *out_head, *out_tail;
+   uint32_t out_queued;          /* bytes in output queue */
+   int out_high;                 /* high-water mark exceeded */
+   int out_wait;                 /* waiting until writable */
+   int dgram;                    /* datagram socket, sends are batched */
+   int flush;                    /* in poll_list.flush */
+#if defined(USE_POLL)
+   int pfd_i;                    /* index into poll_list.pfd */
+#endif
 }
 poll_item_t;
 
 typedef struct
 {
-   poll_item_t *pi;
+   int sfd;
+   uint32_t generation;
    int sfd_event;
 }
 poll_item_notify_t;
 
-static struct
+static __thread struct
 {
-   poll_item_t *pi;
+   poll_item_t *pi;              /* indexed by socket descriptor */
+   int pi_allocated;
+#if defined(USE_POLL)
    poll_item_notify_t *pin;
    struct pollfd *pfd;
-   int allocated, used;
+   int allocated;
+#else
+   int epoll_fd;
+#endif
+   int *flush;                   /* datagram sockets with queued sends */
+   int flush_allocated, flush_used;
+   uint32_t generation;
+   int used;
 }
-poll_list;
+poll_list
+#if !defined(USE_POLL)
+   = { .epoll_fd = -1 }
+#endif
+;
 
-int sfd_wait(sfd_callback_t cb)
+#define SFD_REGISTER_INCREMENT 64
+
+#if defined(USE_POLL)
+
+static int sfd_poll_add(int sfd, poll_item_t *pi)
 {
-   poll_item_t *pi;
-   struct pollfd *pfd;
-   int i, cnt = 0;
+   if (poll_list.used + 1 > poll_list.allocated)
+   {
+      poll_item_notify_t *pin;
+      struct pollfd *pfd;
+      int allocate = (  (poll_list.used + SFD_REGISTER_INCREMENT)
+                      / SFD_REGISTER_INCREMENT) * SFD_REGISTER_INCREMENT;
+
+      pin = realloc(poll_list.pin,
+                    allocate * sizeof(poll_item_notify_t));
+      if (pin == NULL)
+      {
+         log_printf(LOG_ERROR, "sfd_register:"
+            " Memory allocation failed (%u bytes)",
+            (unsigned int)(allocate * sizeof(poll_item_notify_t)));
+         return 0;
+      }
+      poll_list.pin = pin;
 
-   for (pi = poll_list.pi; pi != NULL; pi = pi->next)
+      pfd = realloc(poll_list.pfd,
+                    allocate * sizeof(struct pollfd));
+      if (pfd == NULL)
+      {
+         log_printf(LOG_ERROR, "sfd_register:"
+            " Memory allocation failed (%u bytes)",
+            (unsigned int)(allocate * sizeof(struct pollfd)));
+         return 0;
+      }
+      poll_list.pfd = pfd;
+
+      poll_list.allocated = allocate;
+   }
+
+   pi->pfd_i = poll_list.used;
+   poll_list.pfd[pi->pfd_i].fd = sfd;
+   poll_list.pfd[pi->pfd_i].events = POLLIN;
+   poll_list.pfd[pi->pfd_i].revents = 0;
+   return 1;
+}
+
+static int sfd_poll_modify(int sfd, poll_item_t *pi)
+{
+   poll_list.pfd[pi->pfd_i].events =   (pi->paused ? 0 : POLLIN)
+                                     | (pi->out_wait ? POLLOUT : 0);
+   return 1;
+}
+
+static void sfd_poll_remove(poll_item_t *pi)
+{
+   /* poll_list.used already decremented */
+
+   if (pi->pfd_i != poll_list.used)
    {
-      assert(cnt < poll_list.used);
-      pfd = poll_list.pfd + cnt++;
+      /* move last pollfd into the vacant slot */
 
-      pfd->fd = pi->sfd;
-      pfd->events = POLLIN;
-      pfd->revents = 0;
+      struct pollfd *pfd = poll_list.pfd + pi->pfd_i;
+      *pfd = poll_list.pfd[poll_list.used];
+      poll_list.pi[pfd->fd].pfd_i = pi->pfd_i;
    }
+}
+
+#else
+
+static int sfd_poll_add(int sfd, poll_item_t *pi)
+{
+   struct epoll_event event;
+
+   if (poll_list.epoll_fd == -1)
+   {
+      poll_list.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      if (poll_list.epoll_fd == -1)
+      {
+         int err_no = errno;
+         log_printf(LOG_ERROR, "sfd_register: "
+            "epoll_create1 [%d] %s", err_no, strerror(err_no));
+         return 0;
+      }
+   }
+
+   memset(&event, 0, sizeof(event));
+   event.events = EPOLLIN;
+   event.data.u64 = (uint64_t)pi->generation << 32 | (uint32_t)sfd;
+
+   if (epoll_ctl(poll_list.epoll_fd, EPOLL_CTL_ADD, sfd, &event) == -1)
+   {
+      int err_no = errno;
+      log_printf(LOG_ERROR, "sfd_register: "
+         "epoll_ctl(EPOLL_CTL_ADD) [%d] %s", err_no, strerror(err_no));
+      return 0;
+   }
+
+   return 1;
+}
+
+static int sfd_poll_modify(int sfd, poll_item_t *pi)
+{
+   struct epoll_event event;
+
+   memset(&event, 0, sizeof(event));
+   event.events =   (pi->paused ? 0 : EPOLLIN)
+                  | (pi->out_wait ? EPOLLOUT : 0);
+   event.data.u64 = (uint64_t)pi->generation << 32 | (uint32_t)sfd;
+
+   if (epoll_ctl(poll_list.epoll_fd, EPOLL_CTL_MOD, sfd, &event) == -1)
+   {
+      int err_no = errno;
+      log_printf(LOG_ERROR, "sfd_poll_modify: "
+         "epoll_ctl(EPOLL_CTL_MOD) [%d] %s", err_no, strerror(err_no));
+      return 0;
+   }
+
+   return 1;
+}
+
+static void sfd_poll_remove(poll_item_t *pi)
+{
+   /* socket already closed, which removes it from the epoll set */
+}
+
+#endif
+
+
+/* output queue */
+
+static void sfd_out_free(poll_item_t *pi)
+{
+   while (pi->out_head != NULL)
+   {
+      sfd_out_t *out = pi->out_head;
+      pi->out_head = out->next;
+      free(out);
+   }
+
+   pi->out_tail = NULL;
+   pi->out_queued = 0;
+   pi->out_high = 0;
+   pi->out_wait = 0;
+}
+
+#define SFD_SEND_BATCH 16
+
+static int sfd_flush_dgram(int sfd, poll_item_t *pi)
+{
+   while (pi->out_head != NULL)
+   {
+      struct mmsghdr msgs[SFD_SEND_BATCH];
+      struct iovec iov[SFD_SEND_BATCH];
+      sfd_out_t *out = pi->out_head;
+      int n, cnt;
+
+      memset(msgs, 0, sizeof(msgs));
+      for (n = 0; out != NULL && n < SFD_SEND_BATCH; n++, out = out->next)
+      {
+         iov[n].iov_base = out->data;
+         iov[n].iov_len = out->len;
+         msgs[n].msg_hdr.msg_iov = iov + n;
+         msgs[n].msg_hdr.msg_iovlen = 1;
+      }
+
+      cnt = sendmmsg(sfd, msgs, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (cnt == -1)
+      {
+         int err_no = errno;
+         if (err_no == EINTR)
+            continue;
+         if (err_no == EAGAIN || err_no == EWOULDBLOCK)
+            return 1;
+
+         log_printf(LOG_DETAIL, "Failed to send data [%d] %s",
+            err_no, strerror(err_no));
+         return 0;
+      }
+
+      assert(cnt <= n);
+      while (cnt--)
+      {
+         out = pi->out_head;
+         pi->out_head = out->next;
+         pi->out_queued -= out->len;
+         free(out);
+      }
+
+      if (pi->out_head == NULL)
+         pi->out_tail = NULL;
+   }
+
+   return 1;
+}
+
+static int sfd_flush(int sfd, poll_item_t *pi)
+{
+   if (pi->dgram && !sfd_flush_dgram(sfd, pi))
+      return 0;
+
+   while (pi->out_head != NULL && !pi->dgram)
+   {
+      sfd_out_t *out = pi->out_head;
+      ssize_t l = send(sfd, out->data + out->offs, out->len - out->offs,
+                       MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (l == -1)
+      {
+         int err_no = errno;
+         if (err_no == EINTR)
+            continue;
+         if (err_no == EAGAIN || err_no == EWOULDBLOCK)
+            break;
+
+         log_printf(LOG_DETAIL, "Failed to send data [%d] %s",
+            err_no, strerror(err_no));
+         return 0;
+      }
+
+      assert(l <= out->len - out->offs);
+      out->offs += l;
+      pi->out_queued -= l;
+
+      if (out->offs == out->len)
+      {
+         pi->out_head = out->next;
+         if (pi->out_head == NULL)
+            pi->out_tail = NULL;
+         free(out);
+      }
+   }
+
+   if ((pi->out_head != NULL) != pi->out_wait)
+   {
+      /* wait for POLLOUT while data remains queued */
+      pi->out_wait = pi->out_head != NULL;
+      return sfd_poll_modify(sfd, pi);
+   }
+
+   return 1;
+}
+
+static int sfd_flush_event(int sfd, poll_item_t *pi)
+{
+   /* notify when output queue drained below low-water mark */
+
+   if (!sfd_flush(sfd, pi))
+      return SFD_EVENT_ERROR;
+
+   if (pi->out_high && pi->out_queued <= SFD_QUEUE_LOW_WATER)
+   {
+      pi->out_high = 0;
+      return SFD_EVENT_WRITE;
+   }
+
+   return 0;
+}
+
+static int sfd_flush_later(int sfd, poll_item_t *pi)
+{
+   if (pi->flush)
+      return 1;
+
+   if (poll_list.flush_used == poll_list.flush_allocated)
+   {
+      int allocate = poll_list.flush_allocated + SFD_REGISTER_INCREMENT;
+      int *flush = realloc(poll_list.flush, allocate * sizeof(int));
+      if (flush == NULL)
+      {
+         log_printf(LOG_ERROR, "sfd_transmit:"
+            " Memory allocation failed (%u bytes)",
+            (unsigned int)(allocate * sizeof(int)));
+         return 0;
+      }
+
+      poll_list.flush = flush;
+      poll_list.flush_allocated = allocate;
+   }
+
+   poll_list.flush[poll_list.flush_used++] = sfd;
+   pi->flush = 1;
+   return 1;
+}
+
+static void sfd_flush_pending(sfd_callback_t cb)
+{
+   int i;
+
+   /* callbacks may queue more datagrams */
+
+   for (i = 0; i < poll_list.flush_used; i++)
+   {
+      int sfd = poll_list.flush[i], sfd_event;
+      poll_item_t *pi = poll_list.pi + sfd;
+
+      pi->flush = 0;
+      if (!pi->registered)
+         continue;
+
+      if ((sfd_event = sfd_flush_event(sfd, pi)) != 0)
+         cb(sfd, pi->context, sfd_event);
+   }
+
+   poll_list.flush_used = 0;
+}
+
+static void sfd_notify(sfd_callback_t cb, const poll_item_notify_t *pin)
+{
+   poll_item_t *pi = poll_list.pi + pin->sfd;
+   int sfd_event = pin->sfd_event;
+
+   if (!pi->registered || pi->generation != pin->generation)
+      return;
+
+   if (sfd_event & SFD_EVENT_WRITE)
+   {
+      sfd_event &= ~SFD_EVENT_WRITE;
+      sfd_event |= sfd_flush_event(pin->sfd, pi);
+   }
+
+   if (pi->paused)
+      sfd_event &= ~SFD_EVENT_DATA;
+
+   if (sfd_event)
+      cb(pin->sfd, pi->context, sfd_event);
+}
+
+#if defined(USE_POLL)
+
+static int sfd_poll_wait(sfd_callback_t cb, int timeout)
+{
+   struct pollfd *pfd;
+   int i, cnt;
 
-   assert(cnt == poll_list.used);
    for (;;)
    {
-      cnt = poll(poll_list.pfd, poll_list.used, -1);
-      if (cnt > 0)
+      cnt = poll(poll_list.pfd, poll_list.used, timeout);
+      if (cnt >= 0)
          break;
 
       if (cnt == -1)
@@ -93,13 +462,11 @@ int sfd_wait(sfd_callback_t cb)
       }
    }
 
-   pi = poll_list.pi;
    pfd = poll_list.pfd;
 
-   for (i = 0; i < cnt;)
+   for (i = 0; i < cnt; pfd++)
    {
-      assert(pi != NULL);
-      assert(pi->sfd == pfd->fd);
+      assert(pfd < poll_list.pfd + poll_list.used);
 
       if (pfd->revents)
       {
@@ -108,31 +475,98 @@ int sfd_wait(sfd_callback_t cb)
          assert(!(pfd->revents & POLLNVAL));
          if (pfd->revents & POLLIN)
             sfd_event |= SFD_EVENT_DATA;
+         if (pfd->revents & POLLOUT)
+            sfd_event |= SFD_EVENT_WRITE;
          if (pfd->revents & POLLERR)
             sfd_event |= SFD_EVENT_ERROR;
          if (pfd->revents & POLLHUP)
             sfd_event |= SFD_EVENT_HANGUP;
 
-         poll_list.pin[i].pi = pi;
+         poll_list.pin[i].sfd = pfd->fd;
+         poll_list.pin[i].generation = poll_list.pi[pfd->fd].generation;
          poll_list.pin[i].sfd_event = sfd_event;
          i++;
       }
+   }
+
+   for (i = 0; i < cnt; i++)
+      sfd_notify(cb, poll_list.pin + i);
+
+   return 1;
+}
+
+#else
 
-      pi = pi->next;
-      pfd++;
+#define SFD_WAIT_EVENTS 64
+
+static int sfd_poll_wait(sfd_callback_t cb, int timeout)
+{
+   struct epoll_event events[SFD_WAIT_EVENTS];
+   int i, cnt;
+
+   for (;;)
+   {
+      cnt = epoll_wait(poll_list.epoll_fd, events, SFD_WAIT_EVENTS, timeout);
+      if (cnt >= 0)
+         break;
+
+      if (cnt == -1)
+      {
+         int err_no = errno;
+         if (err_no == EINTR)
+            continue;
+
+         log_printf(LOG_ERROR, "sfd_wait: "
+            "epoll_wait [%d] %s", err_no, strerror(err_no));
+         return 0;
+      }
    }
 
    for (i = 0; i < cnt; i++)
    {
-      cb(poll_list.pin[i].pi->sfd,
-         poll_list.pin[i].pi->context,
-         poll_list.pin[i].sfd_event);
+      poll_item_notify_t pin;
+
+      /* socket descriptor and generation */
+      pin.sfd = (int)(events[i].data.u64 & 0xffffffff);
+      pin.generation = (uint32_t)(events[i].data.u64 >> 32);
+
+      pin.sfd_event = 0;
+      if (events[i].events & EPOLLIN)
+         pin.sfd_event |= SFD_EVENT_DATA;
+      if (events[i].events & EPOLLOUT)
+         pin.sfd_event |= SFD_EVENT_WRITE;
+      if (events[i].events & EPOLLERR)
+         pin.sfd_event |= SFD_EVENT_ERROR;
+      if (events[i].events & EPOLLHUP)
+         pin.sfd_event |= SFD_EVENT_HANGUP;
+
+      sfd_notify(cb, &pin);
    }
 
    return 1;
 }
 
-#define SFD_REGISTER_INCREMENT 24
+#endif
+
+int sfd_wait(sfd_callback_t cb)
+{
+   int timeout = timer_timeout(), ok;
+
+#if defined(HAVE_IO_URING)
+   if (options.engine == ENGINE_IO_URING)
+      ok = uring_wait(cb, timeout);
+   else
+#endif
+   ok = sfd_poll_wait(cb, timeout);
+
+   if (ok)
+   {
+      timer_run();
+      sfd_flush_pending(cb);
+   }
+
+   return ok;
+}
 
 int sfd_register(int sfd, void *context, sfd_cleanup_t cleanup)
 {
@@ -141,53 +575,61 @@ int sfd_register(int sfd, void *context, sfd_cleanup_t cleanup)
    if (sfd == -1)
       return 0;
 
-   if (poll_list.used + 1 > poll_list.allocated)
+   if (sfd >= poll_list.pi_allocated)
    {
-      poll_item_notify_t *pin;
-      struct pollfd *pfd;
-      int allocate = (  (poll_list.used + SFD_REGISTER_INCREMENT)
+      /* multiple of SFD_REGISTER_INCREMENT > sfd */
+      int allocate = (  (sfd + SFD_REGISTER_INCREMENT)
                       / SFD_REGISTER_INCREMENT) * SFD_REGISTER_INCREMENT;
 
-      pin = realloc(poll_list.pin,
-                    allocate * sizeof(poll_item_notify_t));
-      if (pin == NULL)
+      pi = realloc(poll_list.pi, allocate * sizeof(poll_item_t));
+      if (pi == NULL)
       {
          log_printf(LOG_ERROR, "sfd_register:"
             " Memory allocation failed (%u bytes)",
-            (unsigned int)(allocate * sizeof(poll_item_notify_t)));
+            (unsigned int)(allocate * sizeof(poll_item_t)));
          return 0;
       }
 
-      pfd = realloc(poll_list.pfd,
-                    allocate * sizeof(struct pollfd));
-      if (pfd == NULL)
-      {
-         log_printf(LOG_ERROR, "sfd_register:"
-            " Memory allocation failed (%u bytes)",
-            (unsigned int)(allocate * sizeof(struct pollfd)));
-         free(pin);
-         return 0;
-      }
+      memset(pi + poll_list.pi_allocated, 0,
+             (allocate - poll_list.pi_allocated) * sizeof(poll_item_t));
 
-      poll_list.pin = pin;
-      poll_list.pfd = pfd;
-      poll_list.allocated = allocate;
+      poll_list.pi = pi;
+      poll_list.pi_allocated = allocate;
    }
 
-   pi = malloc(sizeof(poll_item_t));
-   if (pi == NULL)
+   pi = poll_list.pi + sfd;
+   assert(!pi->registered);
+
+   pi->generation = ++poll_list.generation;
+
+#if defined(HAVE_IO_URING)
+   if (options.engine == ENGINE_IO_URING)
    {
-      log_printf(LOG_ERROR, "sfd_register:"
-         " Memory allocation failed (%u bytes)",
-         (unsigned int)sizeof(poll_item_t));
-      return 0;
+      if (!uring_init() || !uring_register(sfd, context))
+         return 0;
+   }
+   else
+#endif
+   {
+      int32_t sock_opt;
+      socklen_t sock_opt_l = sizeof(sock_opt);
+
+      if (!sfd_poll_add(sfd, pi))
+         return 0;
+
+      /* fails with ENOTSOCK on the worker inbox eventfd */
+      pi->dgram = 0;
+      if (   getsockopt(sfd, SOL_SOCKET, SO_TYPE, &sock_opt, &sock_opt_l) == 0
+          && sock_opt == SOCK_DGRAM)
+      {
+         pi->dgram = 1;
+      }
    }
 
-   pi->next = poll_list.pi;
-   pi->sfd = sfd;
    pi->context = context;
    pi->cleanup = cleanup;
-   poll_list.pi = pi;
+   pi->registered = 1;
+   pi->paused = 0;
 
    poll_list.used++;
    return 1;
@@ -195,29 +637,56 @@ int sfd_register(int sfd, void *context, sfd_cleanup_t cleanup)
 
 static void sfd_unregister(int *sfd_p)
 {
-   poll_item_t **pi_p = &poll_list.pi;
-   while (*pi_p != NULL)
+   int sfd = *sfd_p;
+   poll_item_t *pi;
+
+   *sfd_p = -1;
+   if (sfd >= poll_list.pi_allocated || !poll_list.pi[sfd].registered)
    {
-      poll_item_t *pi = *pi_p;
-      if (pi->sfd == *sfd_p)
-      {
-         *sfd_p = -1;
+      /* not registered */
+      return;
+   }
 
-         assert(poll_list.used > 0);
-         poll_list.used--;
+   pi = poll_list.pi + sfd;
+   pi->registered = 0;
 
-         *pi_p = pi->next;
-         if (pi->cleanup)
-            pi->cleanup(pi->context);
-         free(pi);
-         return;
-      }
+   assert(poll_list.used > 0);
+   poll_list.used--;
+
+#if defined(HAVE_IO_URING)
+   if (options.engine == ENGINE_IO_URING)
+      uring_unregister(sfd);
+   else
+#endif
+   sfd_poll_remove(pi);
+
+   sfd_out_free(pi);
+
+   if (pi->cleanup)
+      pi->cleanup(pi->context);
+}
 
-      pi_p = &(*pi_p)->next;
+void sfd_pause(int sfd, int pause)
+{
+   poll_item_t *pi;
+
+   if (   sfd == -1
+       || sfd >= poll_list.pi_allocated
+       || !poll_list.pi[sfd].registered
+       || poll_list.pi[sfd].paused == !!pause)
+   {
+      return;
    }
 
-   /* not registered */
-   *sfd_p = -1;
+   pi = poll_list.pi + sfd;
+   pi->paused = !!pause;
+
+#if defined(HAVE_IO_URING)
+   if (options.engine == ENGINE_IO_URING)
+      uring_pause(sfd, pi->paused);
+   else
+#endif
+   sfd_poll_modify(sfd, pi);
 }
 
 
@@ -256,7 +725,7 @@ int tcp_listen(int *sfd_p, const char *addr, uint8_t addr_l,
       return 0;
    }
 
-   *sfd_p = socket(AF_INET, SOCK_STREAM, 0);
+   *sfd_p = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
    if (*sfd_p == -1)
    {
       int err_no = errno;
@@ -275,6 +744,24 @@ int tcp_listen(int *sfd_p, const char *addr, uint8_t addr_l,
          err_no, strerror(err_no));
    }
 
+   if (options.workers > 1)
+   {
+      /* each worker binds its own server socket */
+
+      sock_opt = 1;
+      if (setsockopt(*sfd_p, SOL_SOCKET, SO_REUSEPORT,
+                     &sock_opt, sizeof(sock_opt)) == -1)
+      {
+         int err_no = errno;
+         log_printf(LOG_ERROR, "tcp_listen: "
+            "setsockopt(SOL_SOCKET,SO_REUSEPORT) [%d] %s",
+            err_no, strerror(err_no));
+         close(*sfd_p);
+         *sfd_p = -1;
+         return 0;
+      }
+   }
+
    memset(&sock_addr, 0, sizeof(sock_addr));
    sock_addr.sin_family = AF_INET;
    sock_addr.sin_addr.s_addr = net_addr;
@@ -340,7 +827,7 @@ int udp_bind(int *sfd_p, const char *addr, uint8_t addr_l,
       return 0;
    }
 
-   *sfd_p = socket(AF_INET, SOCK_DGRAM, 0);
+   *sfd_p = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
    if (*sfd_p == -1)
    {
       int err_no = errno;
@@ -359,6 +846,24 @@ int udp_bind(int *sfd_p, const char *addr, uint8_t addr_l,
          err_no, strerror(err_no));
    }
 
+   if (options.workers > 1)
+   {
+      /* each worker binds its own server socket */
+
+      sock_opt = 1;
+      if (setsockopt(*sfd_p, SOL_SOCKET, SO_REUSEPORT,
+                     &sock_opt, sizeof(sock_opt)) == -1)
+      {
+         int err_no = errno;
+         log_printf(LOG_ERROR, "udp_bind: "
+            "setsockopt(SOL_SOCKET,SO_REUSEPORT) [%d] %s",
+            err_no, strerror(err_no));
+         close(*sfd_p);
+         *sfd_p = -1;
+         return 0;
+      }
+   }
+
    sock_opt = 1;
    if (setsockopt(*sfd_p, IPPROTO_IP, IP_PKTINFO,
                   &sock_opt, sizeof(sock_opt)) == -1)
@@ -412,21 +917,34 @@ void sfd_close(int *sfd_p)
    accept TCP connection
    ------------------------------------------------------------------------ */
 
-int tcp_accept(int *sfd_p, int listen_sfd,
-               char *peer_addr, uint8_t *peer_addr_l_p,
-               char *peer_port, uint8_t *peer_port_l_p)
+int tcp_accept(int *sfd_p, int listen_sfd, addr_t *peer)
 {
    struct sockaddr_in sock_addr;
    socklen_t sock_addr_l;
    int32_t sock_opt;
 
-   assert(peer_addr != NULL);
-   assert(peer_addr_l_p != NULL);
-   assert(peer_port != NULL);
-   assert(peer_port_l_p != NULL);
+   assert(peer != NULL);
+
+#if defined(HAVE_IO_URING)
+   if (options.engine == ENGINE_IO_URING)
+   {
+      /* connection accepted by multishot accept */
+
+      *sfd_p = uring_accept(listen_sfd);
+      if (*sfd_p == -1)
+      {
+         log_printf(LOG_ERROR, "tcp_accept: No connection pending");
+         return 0;
+      }
+   }
+   else
+#endif
+   {
+      sock_addr_l = sizeof(sock_addr);
+      *sfd_p = accept4(listen_sfd, (void *)&sock_addr, &sock_addr_l,
+                       SOCK_NONBLOCK);
+   }
 
-   sock_addr_l = sizeof(sock_addr);
-   *sfd_p = accept(listen_sfd, (void *)&sock_addr, &sock_addr_l);
    if (*sfd_p == -1)
    {
       int err_no = errno;
@@ -446,8 +964,7 @@ int tcp_accept(int *sfd_p, int listen_sfd,
       return 0;
    }
 
-   addr_ntoa(peer_addr, peer_addr_l_p, sock_addr.sin_addr.s_addr);
-   port_ntoa(peer_port, peer_port_l_p, sock_addr.sin_port);
+   addr_set(peer, sock_addr.sin_addr.s_addr, sock_addr.sin_port);
 
    sock_opt = 1;
    if (setsockopt(*sfd_p, SOL_SOCKET, SO_KEEPALIVE,
@@ -477,36 +994,17 @@ int tcp_accept(int *sfd_p, int listen_sfd,
    connect TCP
    ------------------------------------------------------------------------ */
 
-int tcp_connect(int *sfd_p, const char *addr, uint8_t addr_l,
-                            const char *port, uint8_t port_l)
+#define TCP_CONNECT_SYNCNT 2     /* SYN retransmits, connect timeout ~7s */
+
+int tcp_connect(int *sfd_p, const addr_t *addr)
 {
    struct sockaddr_in sock_addr;
-   uint32_t net_addr;
-   uint16_t net_port;
    int32_t sock_opt;
 
    assert(addr != NULL);
-   assert(addr_l != 0);
-   assert(port != NULL);
-   assert(port_l != 0);
-
-   if (!addr_aton(&net_addr, addr, addr_l))
-   {
-      log_printf(LOG_ERROR, "tcp_connect: "
-         "Invalid address '%.*s'", addr_l, addr);
-      *sfd_p = -1;
-      return 0;
-   }
-
-   if (!port_aton(&net_port, port, port_l))
-   {
-      log_printf(LOG_ERROR, "tcp_connect: "
-         "Invalid port '%.*s'", port_l, port);
-      *sfd_p = -1;
-      return 0;
-   }
+   assert(addr->in_port != 0);
 
-   *sfd_p = socket(AF_INET, SOCK_STREAM, 0);
+   *sfd_p = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
    if (*sfd_p == -1)
    {
       int err_no = errno;
@@ -545,19 +1043,35 @@ int tcp_connect(int *sfd_p, const char *addr, uint8_t addr_l,
          err_no, strerror(err_no));
    }
 
+   sock_opt = TCP_CONNECT_SYNCNT;
+   if (setsockopt(*sfd_p, IPPROTO_TCP, TCP_SYNCNT,
+                  &sock_opt, sizeof(sock_opt)) == -1)
+   {
+      int err_no = errno;
+      log_printf(LOG_VERBOSE, "tcp_connect: "
+         "setsockopt(IPPROTO_TCP,TCP_SYNCNT) [%d] %s",
+         err_no, strerror(err_no));
+   }
+
    memset(&sock_addr, 0, sizeof(sock_addr));
    sock_addr.sin_family = AF_INET;
-   sock_addr.sin_addr.s_addr = net_addr;
-   sock_addr.sin_port = net_port;
+   sock_addr.sin_addr.s_addr = addr->in_addr;
+   sock_addr.sin_port = addr->in_port;
 
    if (connect(*sfd_p, (void *)&sock_addr, sizeof(sock_addr)) == -1)
    {
       int err_no = errno;
-      log_printf(LOG_ERROR, "tcp_connect: "
-         "Failed to connect socket [%d] %s", err_no, strerror(err_no));
-      close(*sfd_p);
-      *sfd_p = -1;
-      return 0;
+      if (err_no != EINPROGRESS)
+      {
+         log_printf(LOG_ERROR, "tcp_connect: "
+            "Failed to connect socket [%d] %s", err_no, strerror(err_no));
+         close(*sfd_p);
+         *sfd_p = -1;
+         return 0;
+      }
+
+      /* completed by the kernel, data transmitted meanwhile is queued
+         until the socket is writable, failure reported as socket error */
    }
 
    return 1;
@@ -595,38 +1109,17 @@ void tcp_disconnect(int *sfd_p)
    connect UDP
    ------------------------------------------------------------------------ */
 
-int udp_connect(int *sfd_p, const char *addr, uint8_t addr_l,
-                            const char *port, uint8_t port_l,
-                const char *source_addr, uint8_t source_addr_l,
-                const char *source_port, uint8_t source_port_l)
+int udp_connect(int *sfd_p, const addr_t *addr, const addr_t *source)
 {
+   /* bound to source if not NULL, any address if source->in_addr 0 */
+
    struct sockaddr_in sock_addr;
-   uint32_t net_addr;
-   uint16_t net_port;
    int32_t sock_opt;
 
    assert(addr != NULL);
-   assert(addr_l != 0);
-   assert(port != NULL);
-   assert(port_l != 0);
-
-   if (!addr_aton(&net_addr, addr, addr_l))
-   {
-      log_printf(LOG_ERROR, "udp_connect: "
-         "Invalid address '%.*s'", addr_l, addr);
-      *sfd_p = -1;
-      return 0;
-   }
-
-   if (!port_aton(&net_port, port, port_l))
-   {
-      log_printf(LOG_ERROR, "udp_connect: "
-         "Invalid port '%.*s'", port_l, port);
-      *sfd_p = -1;
-      return 0;
-   }
+   assert(addr->in_port != 0);
 
-   *sfd_p = socket(AF_INET, SOCK_DGRAM, 0);
+   *sfd_p = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
    if (*sfd_p == -1)
    {
       int err_no = errno;
@@ -645,37 +1138,14 @@ int udp_connect(int *sfd_p, const char *addr, uint8_t addr_l,
          err_no, strerror(err_no));
    }
 
-   if (source_port_l)
+   if (source != NULL)
    {
-      uint32_t net_source_addr;
-      uint16_t net_source_port;
-
-      if (source_addr_l == 0)
-         net_source_addr = INADDR_ANY;
-      else {
-         assert(source_addr != NULL);
-         if (!addr_aton(&net_source_addr, source_addr, source_addr_l))
-         {
-            log_printf(LOG_ERROR, "udp_connect: "
-               "Invalid address '%.*s'", source_addr_l, source_addr);
-            *sfd_p = -1;
-            return 0;
-         }
-      }
-
-      assert(source_port != NULL);
-      if (!port_aton(&net_source_port, source_port, source_port_l))
-      {
-         log_printf(LOG_ERROR, "udp_connect: "
-            "Invalid port '%.*s'", source_port_l, source_port);
-         *sfd_p = -1;
-         return 0;
-      }
+      assert(source->in_port != 0);
 
       memset(&sock_addr, 0, sizeof(sock_addr));
       sock_addr.sin_family = AF_INET;
-      sock_addr.sin_addr.s_addr = net_source_addr;
-      sock_addr.sin_port = net_source_port;
+      sock_addr.sin_addr.s_addr = source->in_addr;
+      sock_addr.sin_port = source->in_port;
 
       if (bind(*sfd_p, (void *)&sock_addr, sizeof(sock_addr)) == -1)
       {
@@ -690,8 +1160,8 @@ int udp_connect(int *sfd_p, const char *addr, uint8_t addr_l,
 
    memset(&sock_addr, 0, sizeof(sock_addr));
    sock_addr.sin_family = AF_INET;
-   sock_addr.sin_addr.s_addr = net_addr;
-   sock_addr.sin_port = net_port;
+   sock_addr.sin_addr.s_addr = addr->in_addr;
+   sock_addr.sin_port = addr->in_port;
 
    if (connect(*sfd_p, (void *)&sock_addr, sizeof(sock_addr)) == -1)
    {
@@ -749,16 +1219,12 @@ void udp_disconnect(int *sfd_p)
    get local address
    ------------------------------------------------------------------------ */
 
-int sfd_local_addr(int sfd, char *local_addr, uint8_t *local_addr_l_p,
-                            char *local_port, uint8_t *local_port_l_p)
+int sfd_local_addr(int sfd, addr_t *local)
 {
    struct sockaddr_in sock_addr;
    socklen_t sock_addr_l;
 
-   assert(local_addr != NULL);
-   assert(local_addr_l_p != NULL);
-   assert(local_port != NULL);
-   assert(local_port_l_p != NULL);
+   assert(local != NULL);
 
    sock_addr_l = sizeof(sock_addr);
    if (getsockname(sfd, (void *)&sock_addr, &sock_addr_l) == -1)
@@ -769,36 +1235,147 @@ int sfd_local_addr(int sfd, char *local_addr, uint8_t *local_addr_l_p,
       return 0;
    }
 
-   addr_ntoa(local_addr, local_addr_l_p, sock_addr.sin_addr.s_addr);
-   port_ntoa(local_port, local_port_l_p, sock_addr.sin_port);
+   addr_set(local, sock_addr.sin_addr.s_addr, sock_addr.sin_port);
    return 1;
 }
 
 
+/* ------------------------------------------------------------------------
+   get pending socket error
+   ------------------------------------------------------------------------ */
+
+int sfd_error(int sfd)
+{
+   int32_t sock_opt = 0;
+   socklen_t sock_opt_l = sizeof(sock_opt);
+
+   if (getsockopt(sfd, SOL_SOCKET, SO_ERROR, &sock_opt, &sock_opt_l) == -1)
+      return errno;
+
+   return sock_opt;
+}
+
+
 /* ------------------------------------------------------------------------
    transmit data
    ------------------------------------------------------------------------ */
 
-int sfd_transmit(int sfd, const void *data_p, uint16_t data_l)
+int sfd_transmit(int sfd, struct iovec *iov, int iov_n)
 {
-   const char *p = data_p;
-   while (data_l)
+   /* gather iov, which is advanced past data sent */
+
+   poll_item_t *pi;
+   sfd_out_t *out;
+   uint32_t data_l = 0;
+   char *p;
+   int i;
+
+#if defined(HAVE_IO_URING)
+   if (options.engine == ENGINE_IO_URING)
+      return uring_transmit(sfd, iov, iov_n);
+#endif
+
+   if (sfd >= poll_list.pi_allocated || !poll_list.pi[sfd].registered)
+      return 0;
+
+   for (i = 0; i < iov_n; i++)
+      data_l += iov[i].iov_len;
+
+   pi = poll_list.pi + sfd;
+   if (pi->out_head == NULL && !pi->dgram)
    {
-      ssize_t l = send(sfd, p, data_l, MSG_NOSIGNAL);
-      if (l == -1)
+      while (data_l)
       {
-         int err_no = errno;
-         if (err_no == EINTR)
-            continue;
+         struct msghdr msg;
+         ssize_t l;
 
-         log_printf(LOG_DETAIL, "Failed to send data [%d] %s",
-            err_no, strerror(err_no));
-         return 0;
+         /* at most IOV_MAX entries per call, the rest follows */
+         memset(&msg, 0, sizeof(msg));
+         msg.msg_iov = iov;
+         msg.msg_iovlen = iov_n < IOV_MAX ? iov_n : IOV_MAX;
+
+         l = sendmsg(sfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+         if (l == -1)
+         {
+            int err_no = errno;
+            if (err_no == EINTR)
+               continue;
+            if (err_no == EAGAIN || err_no == EWOULDBLOCK)
+               break;
+
+            log_printf(LOG_DETAIL, "Failed to send data [%d] %s",
+               err_no, strerror(err_no));
+            return 0;
+         }
+
+         assert(l <= data_l);
+         data_l -= l;
+
+         while (iov_n && (size_t)l >= iov->iov_len)
+         {
+            l -= iov->iov_len;
+            iov++;
+            iov_n--;
+         }
+
+         if (l)
+         {
+            iov->iov_base = (char *)iov->iov_base + l;
+            iov->iov_len -= l;
+         }
+      }
+
+      if (data_l == 0)
+         return 1;
+   }
+
+   /* remaining data copied and queued until socket is writable,
+      datagrams copied and queued until the end of this event loop
+      iteration */
+
+   out = malloc(sizeof(sfd_out_t) + data_l);
+   if (out == NULL)
+   {
+      log_printf(LOG_ERROR, "sfd_transmit:"
+         " Memory allocation failed (%u bytes)",
+         (unsigned int)(sizeof(sfd_out_t) + data_l));
+      return 0;
+   }
+
+   out->next = NULL;
+   out->offs = 0;
+   out->len = data_l;
+
+   for (p = out->data, i = 0; i < iov_n; i++)
+   {
+      memcpy(p, iov[i].iov_base, iov[i].iov_len);
+      p += iov[i].iov_len;
+   }
+
+   if (pi->out_tail == NULL)
+   {
+      pi->out_head = pi->out_tail = out;
+      if (pi->dgram)
+      {
+         if (!sfd_flush_later(sfd, pi))
+            return 0;
+      }
+      else {
+         pi->out_wait = 1;
+         if (!sfd_poll_modify(sfd, pi))
+            return 0;
       }
+   }
+   else {
+      pi->out_tail->next = out;
+      pi->out_tail = out;
+   }
 
-      assert(l <= data_l);
-      p += l;
-      data_l -= l;
+   pi->out_queued += data_l;
+   if (pi->out_queued > SFD_QUEUE_HIGH_WATER)
+   {
+      pi->out_high = 1;
+      return 2;
    }
 
    return 1;
@@ -809,17 +1386,34 @@ int sfd_transmit(int sfd, const void *data_p, uint16_t data_l)
    receive data
    ------------------------------------------------------------------------ */
 
-int sfd_receive(int sfd, void *data_p, uint16_t data_l)
+int sfd_receive(int sfd, void *data_p, uint32_t *data_l_p)
 {
-   char *p;
+   /* receive up to *data_l_p bytes, 0 if none available */
 
-   if (data_l == 0)
-      return 2;
+#if defined(HAVE_IO_URING)
+   int ok;
+
+   if (   options.engine == ENGINE_IO_URING
+       && (ok = uring_receive(sfd, data_p, data_l_p)) != 0)
+   {
+      return ok;
+   }
+#endif
 
-   p = data_p;
-   while (data_l)
+   for (;;)
    {
-      ssize_t l = recv(sfd, p, data_l, 0);
+      struct msghdr msg;
+      struct iovec iov;
+      ssize_t l;
+
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+
+      iov.iov_base = data_p;
+      iov.iov_len = *data_l_p;
+
+      l = recvmsg(sfd, &msg, MSG_DONTWAIT);
       if (l == 0)
          return 2;
 
@@ -828,124 +1422,116 @@ int sfd_receive(int sfd, void *data_p, uint16_t data_l)
          int err_no = errno;
          if (err_no == EINTR)
             continue;
+         if (err_no == EAGAIN || err_no == EWOULDBLOCK)
+         {
+            *data_l_p = 0;
+            return 1;
+         }
 
          log_printf(LOG_DETAIL, "Failed to receive data [%d] %s",
             err_no, strerror(err_no));
          return 0;
       }
 
-      assert(l <= data_l);
-      p += l;
-      data_l -= l;
-   }
+      if (msg.msg_flags & MSG_TRUNC)
+      {
+         log_printf(LOG_DETAIL, "Datagram exceeds %u bytes",
+            (unsigned int)*data_l_p);
+         return 0;
+      }
 
-   return 1;
+      assert(l <= *data_l_p);
+      *data_l_p = l;
+      return 1;
+   }
 }
 
-int udp_receive(int sfd, void *data_p, uint16_t data_l,
-                char *peer_addr, uint8_t *peer_addr_l_p,
-                char *peer_port, uint8_t *peer_port_l_p,
-                char *local_addr, uint8_t *local_addr_l_p,
-                char *local_port, uint8_t *local_port_l_p)
+int udp_receive(int sfd, udp_dgram_t *dgram, int n)
 {
-   assert(peer_addr != NULL);
-   assert(peer_addr_l_p != NULL);
-   assert(peer_port != NULL);
-   assert(peer_port_l_p != NULL);
-
-   for (;;)
+   struct mmsghdr msgs[UDP_RECEIVE_BATCH];
+   struct iovec iov[UDP_RECEIVE_BATCH];
+   struct sockaddr_in sock_addr[UDP_RECEIVE_BATCH];
+   union
    {
-      struct msghdr msg;
-      struct iovec iov;
-      struct sockaddr_in sock_addr;
-      ssize_t l;
-      unsigned char cmsg_buf[256];
+      struct cmsghdr align;
+      unsigned char buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+   }
+   cmsg_buf[UDP_RECEIVE_BATCH];
+   int i, cnt;
 
-      memset(&msg, 0, sizeof(msg));
-      msg.msg_name = &sock_addr;
-      msg.msg_namelen = sizeof(sock_addr);
-      msg.msg_iov = &iov;
-      msg.msg_iovlen = 1;
-      msg.msg_control = cmsg_buf;
-      msg.msg_controllen = sizeof(cmsg_buf);
+   assert(n > 0 && n <= UDP_RECEIVE_BATCH);
 
-      iov.iov_base = data_p;
-      iov.iov_len = data_l;
+   memset(msgs, 0, n * sizeof(struct mmsghdr));
+   for (i = 0; i < n; i++)
+   {
+      iov[i].iov_base = dgram[i].data;
+      iov[i].iov_len = UDP_RECEIVE_MAX;
+
+      msgs[i].msg_hdr.msg_name = sock_addr + i;
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      msgs[i].msg_hdr.msg_iov = iov + i;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = cmsg_buf + i;
+      msgs[i].msg_hdr.msg_controllen = sizeof(cmsg_buf[i]);
+   }
 
-      l = recvmsg(sfd, &msg, 0);
-      if (l == -1)
+   for (;;)
+   {
+      cnt = recvmmsg(sfd, msgs, n, MSG_DONTWAIT, NULL);
+      if (cnt >= 0)
+         break;
+
+      if (cnt == -1)
       {
          int err_no = errno;
          if (err_no == EINTR)
             continue;
+         if (err_no == EAGAIN || err_no == EWOULDBLOCK)
+            return 0;
 
          log_printf(LOG_DETAIL, "Failed to receive UDP data [%d] %s",
             err_no, strerror(err_no));
          return -1;
       }
+   }
 
-      assert(l <= data_l);
+   for (i = 0; i < cnt; i++)
+   {
+      struct msghdr *msg = &msgs[i].msg_hdr;
+      struct cmsghdr *cmsg;
 
-      addr_ntoa(peer_addr, peer_addr_l_p, sock_addr.sin_addr.s_addr);
-      port_ntoa(peer_port, peer_port_l_p, sock_addr.sin_port);
+      addr_set(&dgram[i].peer,
+               sock_addr[i].sin_addr.s_addr, sock_addr[i].sin_port);
 
-      if (local_addr_l_p)
+      addr_set(&dgram[i].local, INADDR_ANY, 0);
+      for (cmsg = CMSG_FIRSTHDR(msg);
+           cmsg != NULL;
+           cmsg = CMSG_NXTHDR(msg, cmsg))
       {
-         struct cmsghdr *cmsg;
-         assert(local_addr != NULL);
-
-         for (cmsg = CMSG_FIRSTHDR(&msg);
-              cmsg != NULL;
-              cmsg = CMSG_NXTHDR(&msg, cmsg))
+         if (   cmsg->cmsg_level == IPPROTO_IP
+             && cmsg->cmsg_type == IP_PKTINFO)
          {
-            if (   cmsg->cmsg_level == IPPROTO_IP
-                && cmsg->cmsg_type == IP_PKTINFO)
-            {
-               struct in_pktinfo *pktinfo = (void *)CMSG_DATA(cmsg);
-               addr_ntoa(local_addr, local_addr_l_p,
-                         pktinfo->ipi_spec_dst.s_addr);
-               break;
-            }
+            struct in_pktinfo *pktinfo = (void *)CMSG_DATA(cmsg);
+            dgram[i].local.in_addr = pktinfo->ipi_spec_dst.s_addr;
+            break;
          }
       }
 
-      if (local_port_l_p)
+      dgram[i].data_l = msgs[i].msg_len;
+      if (msg->msg_flags & MSG_TRUNC)
       {
-         socklen_t sock_addr_l = sizeof(sock_addr);
-         assert(local_port != NULL);
-
-         if (getsockname(sfd, (void *)&sock_addr, &sock_addr_l) == -1)
-         {
-            int err_no = errno;
-            log_printf(LOG_ERROR, "udp_receive: "
-               "Failed to get local info [%d] %s", err_no, strerror(err_no));
-            return 0;
-         }
-
-         port_ntoa(local_port, local_port_l_p, sock_addr.sin_port);
+         addr_text(&dgram[i].peer);
+         log_printf(LOG_VERBOSE, "Packet from %.*s:%.*s/udp exceeds %u bytes,"
+            " dropped",
+            dgram[i].peer.addr_l, dgram[i].peer.addr,
+            dgram[i].peer.port_l, dgram[i].peer.port,
+            (unsigned int)UDP_RECEIVE_MAX);
+
+         dgram[i].data_l = -1;
       }
-
-      return l;
-   }
-}
-
-
-/* ------------------------------------------------------------------------
-   get number of bytes immediately available for reading
-   ------------------------------------------------------------------------ */
-
-int sfd_available(int sfd)
-{
-   int available;
-   if (ioctl(sfd, FIONREAD, &available) == -1)
-   {
-      int err_no = errno;
-      log_printf(LOG_ERROR, "sfd_available: "
-         "ioctl(FIONREAD) [%d] %s", err_no, strerror(err_no));
-      return -1;
    }
 
-   return available;
+   return cnt;
 }
 
 
@@ -953,9 +1539,19 @@ int sfd_available(int sfd)
    utilities
    ------------------------------------------------------------------------ */
 
-int is_addr(const char *p, int l, int *l_p)
+const uint8_t char_class[256] =
+{
+   ['0' ... '9'] = CHAR_DIGIT,
+   ['.'] = CHAR_DOT,
+   [':'] = CHAR_COLON
+};
+
+int addr_parse(const char *p, int l, int *l_p, uint32_t *addr_p)
 {
+   /* dotted quad, value in network byte order */
+
    int addr_l = 0, octet;
+   uint32_t addr = 0;
 
    for (octet = 0; octet < 4; octet++)
    {
@@ -963,28 +1559,32 @@ int is_addr(const char *p, int l, int *l_p)
 
       if (octet > 0)
       {
-         if (addr_l < l && p[addr_l] == '.')
+         if (addr_l < l && char_class[(uint8_t)p[addr_l]] & CHAR_DOT)
             addr_l++;
          else
             break;
       }
 
       octet_v = 0;
-      for (octet_i = 0; octet_i < 3; octet_i++)
-         if (addr_l < l && p[addr_l] >= '0' && p[addr_l] <= '9')
-            octet_v = octet_v * 10 + p[addr_l++] - '0';
-         else
-            break;
+      for (octet_i = 0;
+           octet_i < 3 && addr_l < l && is_digit(p[addr_l]);
+           octet_i++)
+      {
+         octet_v = octet_v * 10 + p[addr_l++] - '0';
+      }
 
       if (octet_i == 0 || octet_v > 255)
          break;
+
+      addr = addr << 8 | octet_v;
    }
 
    if (   octet == 4
        && (   addr_l == l
-           || (p[addr_l] != '.' && (p[addr_l] < '0' || p[addr_l] > '9'))))
+           || !(char_class[(uint8_t)p[addr_l]] & (CHAR_DIGIT | CHAR_DOT))))
    {
       *l_p = addr_l;
+      *addr_p = htonl(addr);
       return 1;
    }
 
@@ -992,12 +1592,35 @@ int is_addr(const char *p, int l, int *l_p)
    return 0;
 }
 
+int is_addr(const char *p, int l, int *l_p)
+{
+   uint32_t addr;
+
+   return addr_parse(p, l, l_p, &addr);
+}
+
 void addr_ntoa(char *to, uint8_t *l_p, uint32_t addr)
 {
+   char *p = to;
+   int shift;
+
    addr = ntohl(addr);
-   *l_p = (uint8_t)sprintf(to, "%u.%u.%u.%u",
-                           (addr >> 24) & 0xff, (addr >> 16) & 0xff,
-                           (addr >> 8) & 0xff, addr & 0xff);
+   for (shift = 24; shift >= 0; shift -= 8)
+   {
+      unsigned int octet = (addr >> shift) & 0xff;
+
+      if (octet >= 100)
+         *p++ = '0' + octet / 100;
+      if (octet >= 10)
+         *p++ = '0' + octet / 10 % 10;
+      *p++ = '0' + octet % 10;
+
+      if (shift)
+         *p++ = '.';
+   }
+
+   *p = '\0';
+   *l_p = (uint8_t)(p - to);
 }
 
 int addr_aton(uint32_t *addr_p, const char *addr, uint8_t addr_l)
@@ -1026,15 +1649,12 @@ int addr_aton(uint32_t *addr_p, const char *addr, uint8_t addr_l)
 int is_port(const char *p, int l, int *l_p)
 {
    int port_l = 0, port_v = 0;
-   while (port_l < l)
+
+   /* no leading zero, at most 6 digits evaluated */
+   while (   port_l < l && port_l <= 5 && is_digit(p[port_l])
+          && (port_v != 0 || p[port_l] != '0'))
    {
-      if (   (port_v == 0 && p[port_l] >= '1' && p[port_l] <= '9')
-          || (port_v != 0 && p[port_l] >= '0' && p[port_l] <= '9'))
-      {
-         port_v = port_v * 10 + p[port_l++] - '0';
-      }
-      else
-         break;
+      port_v = port_v * 10 + p[port_l++] - '0';
    }
 
    if (port_l > 0 && port_l <= 5 && port_v > 0 && port_v < 65536)
@@ -1049,7 +1669,19 @@ int is_port(const char *p, int l, int *l_p)
 
 void port_ntoa(char *to, uint8_t *l_p, uint16_t port)
 {
-   *l_p = (uint8_t)sprintf(to, "%u", ntohs(port));
+   char tmp[5], *p = tmp + sizeof(tmp);
+   unsigned int port_v = ntohs(port);
+
+   do
+   {
+      *--p = '0' + port_v % 10;
+      port_v /= 10;
+   }
+   while (port_v);
+
+   *l_p = (uint8_t)(tmp + sizeof(tmp) - p);
+   memcpy(to, p, *l_p);
+   to[*l_p] = '\0';
 }
 
 int port_aton(uint16_t *port_p, const char *port, uint8_t port_l)
@@ -1077,3 +1709,49 @@ int port_aton(uint16_t *port_p, const char *port, uint8_t port_l)
    *port_p = 0;
    return 0;
 }
+
+void addr_set(addr_t *a, uint32_t addr, uint16_t port)
+{
+   /* text rendered by addr_text() when used */
+
+   a->in_addr = addr;
+   a->in_port = port;
+   a->addr_l = a->port_l = 0;
+}
+
+void addr_text(addr_t *a)
+{
+   /* no text for INADDR_ANY and port 0 */
+
+   if (a->addr_l == 0 && a->in_addr != INADDR_ANY)
+      addr_ntoa(a->addr, &a->addr_l, a->in_addr);
+   if (a->port_l == 0 && a->in_port != 0)
+      port_ntoa(a->port, &a->port_l, a->in_port);
+}
+
+int addr_binary(addr_t *a)
+{
+   /* binary form of the text, port optional */
+
+   int l, i, port_v = 0;
+
+   /* decimal like the message scanner, not the inet_addr() forms
+      accepted by addr_aton() */
+
+   a->in_port = 0;
+   if (!addr_parse(a->addr, a->addr_l, &l, &a->in_addr) || l != a->addr_l)
+      return 0;
+
+   if (a->port_l)
+   {
+      if (!is_port(a->port, a->port_l, &l) || l != a->port_l)
+         return 0;
+
+      for (i = 0; i < l; i++)
+         port_v = port_v * 10 + a->port[i] - '0';
+
+      a->in_port = htons((uint16_t)port_v);
+   }
+
+   return 1;
+}
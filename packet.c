@@ -22,6 +22,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 
 /* ------------------------------------------------------------------------
@@ -32,29 +37,65 @@
 
 void buf_cleanup(buf_t *buf)
 {
-   free(buf->p);
+   if (buf->p != NULL && !buf->external)
+      free(buf->p - buf->offs);
    buf->p = NULL;
    buf->allocated = 0;
    buf->used = 0;
+   buf->offs = 0;
+   buf->external = 0;
+}
+
+static void buf_compact(buf_t *buf)
+{
+   if (buf->offs)
+   {
+      if (buf->used)
+         memmove(buf->p - buf->offs, buf->p, buf->used);
+
+      buf->p -= buf->offs;
+      buf->allocated += buf->offs;
+      buf->offs = 0;
+   }
+}
+
+static void buf_consume(buf_t *buf, uint32_t size)
+{
+   /* advance read cursor, data moved only by buf_compact() */
+
+   assert(size <= buf->used);
+   buf->p += size;
+   buf->allocated -= size;
+   buf->used -= size;
+   buf->offs += size;
+
+   if (buf->used == 0)
+      buf_compact(buf);
 }
 
 int buf_resize(buf_t *buf, uint32_t size)
 {
+   if (size > buf->allocated && !buf->external)
+      buf_compact(buf);
+
    if (size > buf->allocated)
    {
+      char *p;
+
       /* multiple of BUF_RESIZE_INCREMENT >= size */
       uint32_t allocate = (  (size + BUF_RESIZE_INCREMENT - 1)
                            / BUF_RESIZE_INCREMENT) * BUF_RESIZE_INCREMENT;
 
-      if (allocate > 65535)
+      if (buf->external)
       {
-         log_printf(LOG_ERROR, "buf_resize:"
-            " Packet size exceeds 64K (%u bytes)",
-            allocate);
-         return 0;
+         /* parsed in place, copy */
+         p = malloc(allocate);
+         if (p != NULL && buf->used)
+            memcpy(p, buf->p, buf->used);
       }
+      else
+         p = realloc(buf->p, allocate);
 
-      char *p = realloc(buf->p, allocate);
       if (p == NULL)
       {
          log_printf(LOG_ERROR, "buf_resize:"
@@ -65,6 +106,8 @@ int buf_resize(buf_t *buf, uint32_t size)
 
       buf->p = p;
       buf->allocated = allocate;
+      buf->offs = 0;
+      buf->external = 0;
    }
 
    return 1;
@@ -82,17 +125,600 @@ static int buf_append(buf_t *buf, const void *add_data, uint32_t add_size)
    return 0;
 }
 
+int buf_own(buf_t *buf)
+{
+   /* copy data not owned before it is reused by the caller */
+
+   if (buf->external)
+   {
+      const char *p = buf->p;
+      uint32_t used = buf->used;
+
+      buf->p = NULL;
+      buf->allocated = buf->used = buf->offs = 0;
+      buf->external = 0;
+
+      if (used)
+         return buf_append(buf, p, used);
+   }
+
+   return 1;
+}
+
+
+/* ------------------------------------------------------------------------
+   header names
+
+   Long and compact (RFC 3261 section 7.3.3) forms of the headers used,
+   placed by a perfect hash over first and last character, both case
+   insensitive. A hash collision fails to compile.
+   ------------------------------------------------------------------------ */
+
+#define HEADER_HASH_SIZE 32
+#define HEADER_HASH(first, last) \
+   ((4 * ((first) | 0x20) + ((last) | 0x20)) & (HEADER_HASH_SIZE - 1))
+
+#define HEADER_NAME(name, first, last, header) \
+   [HEADER_HASH(first, last)] = { name, sizeof(name) - 1, header }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+
+static const struct
+{
+   const char *name;
+   uint8_t l;
+   uint8_t header;
+}
+header_name[HEADER_HASH_SIZE] =
+{
+   HEADER_NAME("via",            'v', 'a', HEADER_VIA),
+   HEADER_NAME("v",              'v', 'v', HEADER_VIA),
+   HEADER_NAME("from",           'f', 'm', HEADER_FROM),
+   HEADER_NAME("f",              'f', 'f', HEADER_FROM),
+   HEADER_NAME("to",             't', 'o', HEADER_TO),
+   HEADER_NAME("t",              't', 't', HEADER_TO),
+   HEADER_NAME("contact",        'c', 't', HEADER_CONTACT),
+   HEADER_NAME("m",              'm', 'm', HEADER_CONTACT),
+   HEADER_NAME("expires",        'e', 's', HEADER_EXPIRES),
+   HEADER_NAME("content-length", 'c', 'h', HEADER_CONTENT_LENGTH),
+   HEADER_NAME("l",              'l', 'l', HEADER_CONTENT_LENGTH),
+   HEADER_NAME("call-id",        'c', 'd', HEADER_CALL_ID),
+   HEADER_NAME("i",              'i', 'i', HEADER_CALL_ID),
+   HEADER_NAME("cseq",           'c', 'q', HEADER_CSEQ),
+   HEADER_NAME("content-type",   'c', 'e', HEADER_CONTENT_TYPE),
+   HEADER_NAME("c",              'c', 'c', HEADER_CONTENT_TYPE)
+};
+
+#pragma GCC diagnostic pop
+
+static enum header_t header_find(const char *p, uint32_t l)
+{
+   /* l > 0, tag characters are letters or '-' */
+
+   uint32_t hash = HEADER_HASH(p[0], p[l - 1]);
+
+   if (   header_name[hash].l == l
+       && !strncasecmp(header_name[hash].name, p, l))
+   {
+      return header_name[hash].header;
+   }
+
+   return HEADER_OTHER;
+}
+
+
+/* ------------------------------------------------------------------------
+   message index
+
+   Header lines, SDP fields and splices of a message are kept in one
+   area per worker rather than in each packet_t, packet_index() indexes
+   a message again after another one used the area.
+   ------------------------------------------------------------------------ */
+
+static __thread packet_index_t packet_scratch;
+
+static void *index_grow(void *array, uint32_t *allocated,
+                        uint32_t increment, size_t size)
+{
+   /* array full, room for increment more entries, kept by the worker
+      for following messages, NULL: array unchanged */
+
+   uint32_t allocate = *allocated + increment;
+   void *p = realloc(array, allocate * size);
+
+   if (p == NULL)
+   {
+      log_printf(LOG_ERROR, "packet_index:"
+         " Memory allocation failed (%u bytes)",
+         (unsigned int)(allocate * size));
+      return NULL;
+   }
+
+   *allocated = allocate;
+   return p;
+}
+
+
+/* ------------------------------------------------------------------------
+   SDP
+
+   Address and port fields of an application/sdp body (RFC 4566, a=rtcp
+   RFC 3605, a=candidate RFC 8839) are indexed when the message is
+   complete, rewrites touch these fields only. Addresses other than IPv4
+   are not indexed.
+   ------------------------------------------------------------------------ */
+
+static int sdp_token(const char *p, int *i_p, int l, loc_t *token)
+{
+   /* next space separated token of a line */
+
+   int i = *i_p;
+
+   while (i < l && p[i] == ' ')
+      i++;
+
+   token->offs = i;
+   while (i < l && p[i] != ' ')
+      i++;
+
+   token->len = i - token->offs;
+   *i_p = i;
+   return token->len > 0;
+}
+
+static int sdp_skip(const char *p, int *i_p, int l, int tokens)
+{
+   loc_t token;
+
+   while (tokens--)
+      if (!sdp_token(p, i_p, l, &token))
+         return 0;
+
+   return 1;
+}
+
+static void sdp_addr(const char *p, const loc_t *token, loc_t *addr)
+{
+   /* IPv4 address, c= multicast /ttl suffix excluded */
+
+   int l = 0, addr_l;
+
+   while (l < token->len && p[token->offs + l] != '/')
+      l++;
+
+   if (is_addr(p + token->offs, l, &addr_l) && addr_l == l)
+   {
+      addr->offs = token->offs;
+      addr->len = l;
+   }
+}
+
+static void sdp_port(const char *p, const loc_t *token, loc_t *port)
+{
+   /* m= port count /N suffix excluded */
+
+   int l = 0, port_l;
+
+   while (l < token->len && p[token->offs + l] != '/')
+      l++;
+
+   if (is_port(p + token->offs, l, &port_l) && port_l == l)
+   {
+      port->offs = token->offs;
+      port->len = l;
+   }
+}
+
+static int sdp_field(packet_t *packet, char type, sdp_field_t **field_p)
+{
+   sdp_field_t *field;
+
+   if (packet_scratch.sdp_fields == packet_scratch.sdp_fields_allocated)
+   {
+      field = index_grow(packet_scratch.sdp_field,
+                         &packet_scratch.sdp_fields_allocated,
+                         SDP_FIELDS, sizeof(sdp_field_t));
+      if (field == NULL)
+      {
+         /* index incomplete, body scanned for addresses instead */
+         packet->sdp = 0;
+         return 0;
+      }
+
+      packet_scratch.sdp_field = field;
+   }
+
+   field = packet_scratch.sdp_field + packet_scratch.sdp_fields;
+   field->type = type;
+   field->addr.offs = field->addr.len = 0;
+   field->port.offs = field->port.len = 0;
+
+   *field_p = field;
+   return 1;
+}
+
+static int sdp_attribute(const char *p, int *i_p, int l, const char *name)
+{
+   /* a=name: at line start, skipped */
+
+   int name_l = strlen(name);
+
+   if (   l - *i_p > 2 + name_l
+       && !strncmp(p + *i_p + 2, name, name_l))
+   {
+      *i_p += 2 + name_l;
+      return 1;
+   }
+
+   return 0;
+}
+
+static void sdp_index(packet_t *packet)
+{
+   const char *p = packet->buf.p + packet->header.len;
+   int i = 0, l = packet->data.len;
+
+   packet_scratch.sdp_fields = 0;
+
+   while (i < l)
+   {
+      int line_i = i, line_l, rtcp = 0, candidate = 0;
+      sdp_field_t *field;
+      char type;
+      loc_t token;
+
+      while (i < l && p[i] != '\r' && p[i] != '\n')
+         i++;
+      line_l = i;
+      while (i < l && (p[i] == '\r' || p[i] == '\n'))
+         i++;
+
+      if (line_l - line_i < 2 || p[line_i + 1] != '=')
+         continue;
+
+      type = p[line_i];
+      if (type == 'a')
+      {
+         rtcp = sdp_attribute(p, &line_i, line_l, "rtcp:");
+         candidate = !rtcp && sdp_attribute(p, &line_i, line_l, "candidate:");
+         if (!rtcp && !candidate)
+            continue;
+      }
+      else if (type == 'o' || type == 'c' || type == 'm')
+         line_i += 2;
+      else
+         continue;
+
+      if (!sdp_field(packet, type, &field))
+         return;
+
+      if (type == 'o')
+      {
+         /* username sess-id sess-version nettype addrtype address */
+         if (   sdp_skip(p, &line_i, line_l, 5)
+             && sdp_token(p, &line_i, line_l, &token))
+         {
+            sdp_addr(p, &token, &field->addr);
+         }
+      }
+      else if (type == 'c')
+      {
+         /* nettype addrtype address */
+         if (   sdp_skip(p, &line_i, line_l, 2)
+             && sdp_token(p, &line_i, line_l, &token))
+         {
+            sdp_addr(p, &token, &field->addr);
+         }
+      }
+      else if (type == 'm')
+      {
+         /* media port proto fmt ... */
+         if (   sdp_skip(p, &line_i, line_l, 1)
+             && sdp_token(p, &line_i, line_l, &token))
+         {
+            sdp_port(p, &token, &field->port);
+         }
+      }
+      else if (rtcp)
+      {
+         /* port [nettype addrtype address] */
+         if (sdp_token(p, &line_i, line_l, &token))
+            sdp_port(p, &token, &field->port);
+         if (   sdp_skip(p, &line_i, line_l, 2)
+             && sdp_token(p, &line_i, line_l, &token))
+         {
+            sdp_addr(p, &token, &field->addr);
+         }
+      }
+      else if (sdp_skip(p, &line_i, line_l, 4))
+      {
+         /* candidate: foundation component transport priority
+            address port typ type [raddr address] [rport port] ... */
+
+         loc_t value;
+         int related = 0;
+
+         if (sdp_token(p, &line_i, line_l, &token))
+            sdp_addr(p, &token, &field->addr);
+         if (sdp_token(p, &line_i, line_l, &token))
+            sdp_port(p, &token, &field->port);
+
+         while (   sdp_token(p, &line_i, line_l, &token)
+                && sdp_token(p, &line_i, line_l, &value))
+         {
+            int raddr = token.len == 5 && !strncmp(p + token.offs, "raddr", 5),
+                rport = token.len == 5 && !strncmp(p + token.offs, "rport", 5);
+
+            if (raddr)
+            {
+               if (field->addr.len || field->port.len)
+               {
+                  /* related address, separate field */
+                  packet_scratch.sdp_fields++;
+                  if (!sdp_field(packet, type, &field))
+                     return;
+               }
+
+               sdp_addr(p, &value, &field->addr);
+               related = 1;
+            }
+            else if (rport && related)
+               sdp_port(p, &value, &field->port);
+         }
+      }
+
+      if (field->addr.len || field->port.len)
+         packet_scratch.sdp_fields++;
+   }
+}
+
 
 /* ------------------------------------------------------------------------
    packet assembly
    ------------------------------------------------------------------------ */
 
-#define SIP_MAX_LEN (6 * 1024)
+/* index of first CR or LF in p[i..l), l if none */
+
+static uint32_t line_end(const char *p, uint32_t i, uint32_t l)
+{
+#if defined(__AVX2__)
+   const __m256i cr32 = _mm256_set1_epi8('\r'), lf32 = _mm256_set1_epi8('\n');
+
+   for (; i + 32 <= l; i += 32)
+   {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+      uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+                         _mm256_or_si256(_mm256_cmpeq_epi8(v, cr32),
+                                         _mm256_cmpeq_epi8(v, lf32)));
+      if (mask)
+         return i + __builtin_ctz(mask);
+   }
+#endif
+
+#if defined(__SSE2__)
+   const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+
+   for (; i + 16 <= l; i += 16)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+      uint32_t mask = (uint32_t)_mm_movemask_epi8(
+                         _mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                      _mm_cmpeq_epi8(v, lf)));
+      if (mask)
+         return i + __builtin_ctz(mask);
+   }
+#elif defined(__ARM_NEON)
+   const uint8x16_t cr = vdupq_n_u8('\r'), lf = vdupq_n_u8('\n');
+
+   for (; i + 16 <= l; i += 16)
+   {
+      uint8x16_t v = vld1q_u8((const uint8_t *)p + i);
+      uint8x16_t eq = vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf));
+
+      /* 4 bits per byte */
+      uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                         vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+      if (mask)
+         return i + (__builtin_ctzll(mask) >> 2);
+   }
+#endif
+
+   while (i < l && p[i] != '\r' && p[i] != '\n')
+      i++;
+
+   return i;
+}
+
+static uint32_t digit_next(const char *p, uint32_t i, uint32_t l)
+{
+#if defined(__AVX2__)
+   const __m256i below32 = _mm256_set1_epi8('0' - 1),
+                 above32 = _mm256_set1_epi8('9' + 1);
+
+   for (; i + 32 <= l; i += 32)
+   {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+      uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+                         _mm256_and_si256(_mm256_cmpgt_epi8(v, below32),
+                                          _mm256_cmpgt_epi8(above32, v)));
+      if (mask)
+         return i + __builtin_ctz(mask);
+   }
+#endif
+
+#if defined(__SSE2__)
+   const __m128i below = _mm_set1_epi8('0' - 1), above = _mm_set1_epi8('9' + 1);
+
+   for (; i + 16 <= l; i += 16)
+   {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+      uint32_t mask = (uint32_t)_mm_movemask_epi8(
+                         _mm_and_si128(_mm_cmpgt_epi8(v, below),
+                                       _mm_cmplt_epi8(v, above)));
+      if (mask)
+         return i + __builtin_ctz(mask);
+   }
+#elif defined(__ARM_NEON)
+   const uint8x16_t zero = vdupq_n_u8('0'), nine = vdupq_n_u8('9');
+
+   for (; i + 16 <= l; i += 16)
+   {
+      uint8x16_t v = vld1q_u8((const uint8_t *)p + i);
+      uint8x16_t in = vandq_u8(vcgeq_u8(v, zero), vcleq_u8(v, nine));
+
+      /* 4 bits per byte */
+      uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                         vshrn_n_u16(vreinterpretq_u16_u8(in), 4)), 0);
+      if (mask)
+         return i + (__builtin_ctzll(mask) >> 2);
+   }
+#else
+   /* SWAR, 8 bytes per word: byte ^ '0' < 10 leaves the high bit clear
+      in both (x & 0x7f) + 0x76 and x */
+
+   for (; i + 8 <= l; i += 8)
+   {
+      uint64_t x, mask;
+
+      memcpy(&x, p + i, 8);
+      x ^= 0x3030303030303030ull;
+      mask = ~(((x & 0x7f7f7f7f7f7f7f7full) + 0x7676767676767676ull) | x)
+           & 0x8080808080808080ull;
+      if (mask)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+         return i + (__builtin_ctzll(mask) >> 3);
+#else
+         return i + (__builtin_clzll(mask) >> 3);
+#endif
+   }
+#endif
+
+   while (i < l && !is_digit(p[i]))
+      i++;
+
+   return i;
+}
+
+static int header_line(const char *buf, const loc_t *line,
+                       header_index_t *header, uint32_t *name_l_p)
+{
+   /* tag and value of a header line, 0: not recognized */
+
+   const char *p = buf + line->offs;
+   uint32_t l = 0, i;
+
+   while (l < line->len)
+   {
+      if (   (p[l] < 'A' || p[l] > 'Z')
+          && (p[l] < 'a' || p[l] > 'z')
+          && p[l] != '-')
+      {
+         break;
+      }
+
+      l++;
+   }
+
+   if (l == 0 || l == line->len || p[l] != ':')
+      return 0;
+
+   i = l + 1;
+   while (i < line->len && p[i] == ' ')
+      i++;
+
+   if (i == line->len)
+      return 0;
+
+   header->id = header_find(p, l);
+   header->line = *line;
+   header->value.offs = line->offs + i;
+   header->value.len = line->len - i;
+
+   *name_l_p = l;
+   return 1;
+}
+
+static int index_header(const header_index_t *header)
+{
+   header_index_t *header_index;
+
+   if (packet_scratch.headers == packet_scratch.headers_allocated)
+   {
+      header_index = index_grow(packet_scratch.header_index,
+                                &packet_scratch.headers_allocated,
+                                PACKET_HEADERS, sizeof(header_index_t));
+      if (header_index == NULL)
+         return 0;
+
+      packet_scratch.header_index = header_index;
+   }
+
+   packet_scratch.header_index[packet_scratch.headers++] = *header;
+   return 1;
+}
+
+static void index_claim(packet_t *packet)
+{
+   if (++packet_scratch.seq == 0)
+      packet_scratch.seq++;
+
+   packet->index_seq = packet_scratch.seq;
+
+   packet_scratch.headers = 0;
+   packet_scratch.sdp_fields = 0;
+   packet_scratch.splices = 0;
+}
+
+packet_index_t *packet_index(packet_t *packet)
+{
+   /* index of this message, rebuilt from the lines parsed so far if
+      another message of the worker used the area since */
+
+   if (packet->index_seq == 0 || packet->index_seq != packet_scratch.seq)
+   {
+      uint32_t end = packet->header.len ? packet->header.len
+                                        : packet->current_line.offs,
+               buf_i = 0;
+
+      index_claim(packet);
+
+      while (buf_i < end)
+      {
+         header_index_t header;
+         uint32_t name_l;
+         loc_t line;
+
+         line.offs = buf_i;
+         buf_i = line_end(packet->buf.p, buf_i, end);
+         line.len = buf_i - line.offs;
+
+         if (buf_i < end && packet->buf.p[buf_i] == '\r')
+            buf_i++;
+         buf_i++;
+
+         /* first line is the SIP method or status,
+            index incomplete if the allocation fails */
+         if (   line.offs
+             && header_line(packet->buf.p, &line, &header, &name_l)
+             && !index_header(&header))
+         {
+            break;
+         }
+      }
+
+      if (packet->status == PACKET_READY && packet->sdp && !packet->streamed)
+         sdp_index(packet);
+   }
+
+   return &packet_scratch;
+}
 
 static void reset_packet(packet_t *packet)
 {
    packet->header.len = packet->data.len = 0;
    packet->method.len = 0;
+   packet->streamed = 0;
    packet->current_line.offs = packet->current_line.len = 0;
    packet->via_line.offs = packet->via_line.len = 0;
    packet->via.offs = packet->via.len = 0;
@@ -100,6 +726,155 @@ static void reset_packet(packet_t *packet)
    packet->to.offs = packet->to.len = 0;
    packet->contact.offs = packet->contact.len = 0;
    packet->content_length.offs = packet->content_length.len = 0;
+   packet->expires.offs = packet->expires.len = 0;
+   packet->content_type.offs = packet->content_type.len = 0;
+   packet->rewrite = 0;
+   packet->sdp = 0;
+   packet->via_rport.offs = packet->via_rport.len = 0;
+   packet->via_branch.offs = packet->via_branch.len = 0;
+   packet->via_received.offs = packet->via_received.len = 0;
+   packet->cseq = 0;
+   packet->cseq_method.offs = packet->cseq_method.len = 0;
+   index_claim(packet);
+}
+
+static int body_type_rewrite(const packet_t *packet)
+{
+   /* media type of the Content-Type header, parameters ignored,
+      2: application/sdp */
+
+   const char *p = packet->buf.p + packet->content_type.offs;
+   int l = 0, i;
+
+   if (packet->content_type.offs == 0)
+      return 0;
+
+   while (   l < packet->content_type.len
+          && p[l] != ';' && p[l] != ' ' && p[l] != '\t')
+   {
+      l++;
+   }
+
+   for (i = 0; i < options.body_types; i++)
+   {
+      if (   (int)strlen(options.body_type[i]) == l
+          && !strncasecmp(options.body_type[i], p, l))
+      {
+         return l == 15 && !strncasecmp(p, "application/sdp", l) ? 2 : 1;
+      }
+   }
+
+   return 0;
+}
+
+static void via_params(packet_t *packet)
+{
+   /* parameters of the top Via, up to the first ',' */
+
+   const char *p = packet->buf.p;
+   int i = packet->via.offs, l = i + packet->via.len;
+
+   while (i < l && p[i] != ';' && p[i] != ',')
+      i++;
+
+   while (i < l && p[i] == ';')
+   {
+      int name_i, name_l, value_i, value_l;
+      loc_t *param = NULL;
+
+      i++;
+      while (i < l && p[i] == ' ')
+         i++;
+
+      name_i = i;
+      while (i < l && p[i] != '=' && p[i] != ';' && p[i] != ',' && p[i] != ' ')
+         i++;
+      name_l = i - name_i;
+
+      while (i < l && p[i] == ' ')
+         i++;
+
+      value_i = i;
+      if (i < l && p[i] == '=')
+      {
+         i++;
+         while (i < l && p[i] == ' ')
+            i++;
+
+         value_i = i;
+         while (i < l && p[i] != ';' && p[i] != ',' && p[i] != ' ')
+            i++;
+      }
+      value_l = i - value_i;
+
+      while (i < l && p[i] == ' ')
+         i++;
+
+      if (name_l == 5 && !strncasecmp(p + name_i, "rport", 5))
+         param = &packet->via_rport;
+      else if (name_l == 6 && !strncasecmp(p + name_i, "branch", 6))
+         param = &packet->via_branch;
+      else if (name_l == 8 && !strncasecmp(p + name_i, "received", 8))
+         param = &packet->via_received;
+
+      if (param != NULL && param->offs == 0)
+      {
+         /* len 0: parameter without value */
+         param->offs = value_i;
+         param->len = value_l;
+      }
+   }
+}
+
+static void cseq_parse(packet_t *packet, const loc_t *value)
+{
+   /* sequence number and method, left unset if not recognized */
+
+   const char *p = packet->buf.p;
+   int i = value->offs, l = i + value->len, method_i;
+   uint64_t cseq = 0;
+
+   if (i == l || p[i] < '0' || p[i] > '9')
+      return;
+
+   while (i < l && p[i] >= '0' && p[i] <= '9')
+   {
+      cseq = cseq * 10 + p[i++] - '0';
+      if (cseq >= 0x80000000u)
+         return;
+   }
+
+   if (i == l || p[i] != ' ')
+      return;
+   while (i < l && p[i] == ' ')
+      i++;
+
+   method_i = i;
+   while (   i < l
+          && (   (p[i] >= 'A' && p[i] <= 'Z')
+              || (p[i] >= 'a' && p[i] <= 'z')))
+   {
+      i++;
+   }
+
+   if (i == method_i)
+      return;
+
+   packet->cseq = cseq;
+   packet->cseq_method.offs = method_i;
+   packet->cseq_method.len = i - method_i;
+}
+
+char *packet_buffer(packet_t *packet, uint32_t size)
+{
+   /* space to receive size bytes in place, passed to next_packet() */
+
+   assert(packet->status != PACKET_READY);
+
+   if (!buf_resize(&packet->buf, packet->buf.used + size))
+      return NULL;
+
+   return packet->buf.p + packet->buf.used;
 }
 
 int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
@@ -110,53 +885,59 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
    {
       /* previous packet processed, start new packet */
 
-      uint32_t packet_l = packet->header.len + packet->data.len;
-      assert(packet_l <= packet->buf.used);
-      if (packet_l < packet->buf.used)
-         memmove(packet->buf.p, packet->buf.p + packet_l,
-                 packet->buf.used - packet_l);
-
-      packet->buf.used -= packet_l;
+      buf_consume(&packet->buf, packet->header.len + packet->data.len);
       reset_packet(packet);
    }
 
+   /* header lines are added to the index of this message */
    packet->status = PACKET_INCOMPLETE;
+   packet_index(packet);
+
+   /* buffer may hold pipelined messages, size limit applies per message,
+      packet->stream is not reset with the packet */
 
-   if (packet->buf.used + next_size > 2 * SIP_MAX_LEN)
+   if (next_size && next_data == packet->buf.p + packet->buf.used)
    {
-      log_printf(LOG_VERBOSE, "%s: Packet too large (%u bytes)",
-         log_prefix, packet->buf.used + next_size);
-      packet->status = PACKET_ERROR;
-      return 0;
+      /* received into packet_buffer() */
+      assert(packet->buf.used + next_size <= packet->buf.allocated);
+      packet->buf.used += next_size;
    }
-
-   if (!buf_append(&packet->buf, next_data, next_size))
+   else if (next_size && !buf_append(&packet->buf, next_data, next_size))
    {
       log_printf(LOG_VERBOSE, "%s", log_prefix);
       packet->status = PACKET_ERROR;
       return 0;
    }
 
-   if (packet->header.len == 0)
+   if (packet->stream)
+   {
+      /* streamed body part */
+
+      if (packet->buf.used)
+      {
+         packet->data.len = packet->buf.used < packet->stream
+                          ? packet->buf.used : packet->stream;
+         packet->stream -= packet->data.len;
+         packet->streamed = 1;
+         packet->status = PACKET_READY;
+      }
+   }
+   else if (packet->header.len == 0)
    {
       /* header, get next line */
 
       uint32_t buf_i = packet->current_line.offs + packet->current_line.len;
       for (;;)
       {
-         while (   buf_i < packet->buf.used
-                && packet->buf.p[buf_i] != '\r'
-                && packet->buf.p[buf_i] != '\n')
-         {
-            buf_i++;
-            packet->current_line.len++;
-         }
+         uint32_t line_i = line_end(packet->buf.p, buf_i, packet->buf.used);
+
+         packet->current_line.len += line_i - buf_i;
+         buf_i = line_i;
 
-         if (packet->current_line.len > SIP_MAX_LEN)
+         if (buf_i > options.max_message)
          {
-            log_printf(LOG_VERBOSE, "%s: Header line too long (%u bytes)",
-               log_prefix, packet->current_line.len);
-            log_dump(LOG_VERBOSE, packet->buf.p, buf_i);
+            log_printf(LOG_VERBOSE, "%s: Header too large (%u bytes)",
+               log_prefix, buf_i);
             packet->status = PACKET_ERROR;
             return 0;
          }
@@ -185,17 +966,13 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
             /* header complete */
 
             uint32_t packet_l;
-            int ok = 1;
+            int ok = 1, rewrite;
 
             if (packet->current_line.offs == 0)
             {
                /* ignore keep-alive packet */
 
-               if (buf_i < packet->buf.used)
-                  memmove(packet->buf.p, packet->buf.p + buf_i,
-                          packet->buf.used - buf_i);
-
-               packet->buf.used -= buf_i;
+               buf_consume(&packet->buf, buf_i);
                reset_packet(packet);
 
                buf_i = 0;
@@ -232,11 +1009,50 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
             }
 
             packet->header.len = buf_i;
+            rewrite = packet->data.len ? body_type_rewrite(packet) : 0;
+            packet->rewrite = rewrite != 0;
+            packet->sdp = rewrite == 2;
+
             packet_l = packet->header.len + packet->data.len;
-            if (packet->buf.used >= packet_l)
+            if (packet_l > options.max_message && packet->datagram)
+            {
+               log_printf(LOG_VERBOSE, "%s: Packet too large (%u bytes)",
+                  log_prefix, packet_l);
+               packet->status = PACKET_ERROR;
+               return 0;
+            }
+
+            if (packet_l > options.max_message && packet->rewrite)
+            {
+               /* rewritten bodies are buffered whole, never streamed */
+
+               log_printf(LOG_ERROR, "%s: Message with body to be rewritten"
+                  " exceeds size limit (%u bytes)", log_prefix, packet_l);
+               packet->status = PACKET_ERROR;
+               return 0;
+            }
+
+            if (packet_l > options.max_message)
+            {
+               /* not buffered whole, body not rewritten, forwarded as
+                  received */
+
+               log_printf(LOG_VERBOSE, "Streaming message body"
+                  " (%u bytes)", (uint32_t)packet->data.len);
+
+               packet->streamed = 1;
+               if (packet->buf.used < packet_l)
+               {
+                  packet->stream = packet_l - packet->buf.used;
+                  packet->data.len -= packet->stream;
+               }
+
+               packet->status = PACKET_READY;
+            }
+            else if (packet->buf.used >= packet_l)
                packet->status = PACKET_READY;
 
-            return 1;
+            break;
          }
 
          /* line complete */
@@ -296,30 +1112,10 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
             /* header line, get line tag */
 
             const char *p = packet->buf.p + packet->current_line.offs;
-            uint32_t l = 0, i;
-            int ok;
-
-            while (l < packet->current_line.len)
-            {
-               if (   (p[l] < 'A' || p[l] > 'Z')
-                   && (p[l] < 'a' || p[l] > 'z')
-                   && p[l] != '-')
-               {
-                  break;
-               }
-
-               l++;
-            }
-
-            if (l == 0 || l == packet->current_line.len || p[l] != ':')
-               ok = 0;
-            else {
-               i = l + 1;
-               while (i < packet->current_line.len && p[i] == ' ')
-                  i++;
-
-               ok = i < packet->current_line.len;
-            }
+            header_index_t header;
+            uint32_t l, i;
+            int ok = header_line(packet->buf.p, &packet->current_line,
+                                 &header, &l);
 
             if (!ok)
             {
@@ -330,12 +1126,19 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
                return 0;
             }
 
-            while (ok)
+            if (!index_header(&header))
             {
-               if (l == 3 && !strncasecmp("Via", p, l))
-               {
+               packet->status = PACKET_ERROR;
+               return 0;
+            }
+
+            i = header.value.offs - packet->current_line.offs;
+
+            switch (header.id)
+            {
+               case HEADER_VIA:
                   if (packet->via.offs)
-                  {  
+                  {
                      ok = 0;
                      break;
                   }
@@ -346,33 +1149,35 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
 
                   packet->via.offs = packet->current_line.offs + i;
                   packet->via.len = packet->current_line.len - i;
-               }
-               else if (l == 4 && !strncasecmp("From", p, l))
-               {
+
+                  via_params(packet);
+                  break;
+
+               case HEADER_FROM:
                   if (packet->from.offs)
-                  {  
+                  {
                      ok = 0;
                      break;
                   }
 
                   packet->from.offs = packet->current_line.offs + i;
                   packet->from.len = packet->current_line.len - i;
-               }
-               else if (l == 2 && !strncasecmp("To", p, l))
-               {
+                  break;
+
+               case HEADER_TO:
                   if (packet->to.offs)
-                  {  
+                  {
                      ok = 0;
                      break;
                   }
 
                   packet->to.offs = packet->current_line.offs + i;
                   packet->to.len = packet->current_line.len - i;
-               }
-               else if (l == 7 && !strncasecmp("Contact", p, l))
-               {
+                  break;
+
+               case HEADER_CONTACT:
                   if (packet->contact.offs)
-                  {  
+                  {
                      /* multiple Contact header lines may occur,
                         the first one is used */
                      break;
@@ -380,19 +1185,30 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
 
                   packet->contact.offs = packet->current_line.offs + i;
                   packet->contact.len = packet->current_line.len - i;
-               }
-               else if (l == 14 && !strncasecmp("Content-Length", p, l))
-               {
+                  break;
+
+               case HEADER_EXPIRES:
+                  if (packet->expires.offs)
+                  {
+                     /* not rejected, the first one is used */
+                     break;
+                  }
+
+                  packet->expires.offs = packet->current_line.offs + i;
+                  packet->expires.len = packet->current_line.len - i;
+                  break;
+
+               case HEADER_CONTENT_LENGTH:
                   if (packet->content_length.offs)
-                  {  
+                  {
                      ok = 0;
                      break;
                   }
 
                   assert(packet->data.len == 0);
 
-                  packet->content_length.offs = packet->current_line.offs + l+1;
-                  packet->content_length.len = packet->current_line.len - l-1;
+                  packet->content_length.offs = packet->current_line.offs + i;
+                  packet->content_length.len = packet->current_line.len - i;
 
                   /* get content length */
 
@@ -400,7 +1216,8 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
                      ok = 0;
                   else {
                      while (   i < packet->current_line.len
-                            && p[i] >= '0' && p[i] <= '9')
+                            && p[i] >= '0' && p[i] <= '9'
+                            && packet->data.len <= (INT32_MAX - 9) / 10)
                      {
                         packet->data.len = packet->data.len * 10 + p[i++] - '0';
                      }
@@ -417,9 +1234,28 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
                      packet->status = PACKET_ERROR;
                      return 0;
                   }
-               }
+                  break;
 
-               break;
+               case HEADER_CSEQ:
+                  if (packet->cseq_method.offs == 0)
+                     cseq_parse(packet, &header.value);
+                  break;
+
+               case HEADER_CONTENT_TYPE:
+                  if (packet->content_type.offs)
+                  {
+                     /* not rejected, the first one decides whether
+                        the body is rewritten */
+                     break;
+                  }
+
+                  packet->content_type.offs = packet->current_line.offs + i;
+                  packet->content_type.len = packet->current_line.len - i;
+                  break;
+
+               case HEADER_CALL_ID:
+               case HEADER_OTHER:
+                  break;
             }
 
             if (!ok)
@@ -444,6 +1280,39 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
          packet->status = PACKET_READY;
    }
 
+   if (packet->status == PACKET_READY && packet->sdp && !packet->streamed)
+      sdp_index(packet);
+
+   return 1;
+}
+
+int next_datagram(packet_t *packet, char *data, uint32_t data_l, uint32_t size)
+{
+   /* single message parsed in place, size bytes at data may be used for
+      rewrites, buf_own() before data is reused */
+
+   assert(data_l <= size);
+
+   packet->buf.p = data;
+   packet->buf.allocated = size;
+   packet->buf.used = data_l;
+   packet->buf.offs = 0;
+   packet->buf.external = 1;
+
+   packet->datagram = 1;
+   packet->stream = 0;
+   packet->status = PACKET_INCOMPLETE;
+   reset_packet(packet);
+
+   if (!next_packet(packet, NULL, 0))
+      return 0;
+
+   if (packet->status == PACKET_READY)
+   {
+      /* octets beyond Content-Length are discarded (RFC 3261 18.3) */
+      packet->buf.used = packet->header.len + packet->data.len;
+   }
+
    return 1;
 }
 
@@ -452,90 +1321,134 @@ int next_packet(packet_t *packet, const void *next_data, uint32_t next_size)
    protocol data
    ------------------------------------------------------------------------ */
 
-static void loc_adjust(loc_t *loc, int i, int l, int l_diff)
+int data_splice(packet_t *packet, const data_t *data,
+                int replace_i, int replace_l,
+                const char *with, int with_l)
 {
-   if (i < loc->offs)
-   {
-      assert(i + l <= loc->offs);
-      loc->offs += l_diff;
-   }
-   else if (i < loc->offs + loc->len)
+   /* edit recorded in the splice list, packet_iov() applies all edits
+      on transmit, the packet buffer is not changed */
+
+   packet_index_t *index = packet_index(packet);
+   uint32_t offs = (uint32_t)(data->p - packet->buf.p) + replace_i;
+   splice_t *splice;
+
+   assert(   data->p == packet->buf.p
+          || data->p == packet->buf.p + packet->header.len);
+   assert(offs + replace_l <= packet->header.len + packet->data.len);
+   assert(with_l <= (int)sizeof(splice->with));
+
+   if (with_l == replace_l && !memcmp(packet->buf.p + offs, with, with_l))
+      return 1;
+
+   if (index->splices == index->splices_allocated)
    {
-      assert(i + l <= loc->offs + loc->len);
-      loc->len += l_diff;
+      splice = index_grow(index->splice, &index->splices_allocated,
+                          PACKET_SPLICES, sizeof(splice_t));
+      if (splice == NULL)
+         return 0;
+
+      index->splice = splice;
    }
+
+   splice = index->splice + index->splices++;
+   splice->offs = offs;
+   splice->len = replace_l;
+   splice->with_l = with_l;
+   memcpy(splice->with, with, with_l);
+
+   return 1;
 }
 
-int data_modify(packet_t *packet, data_t *data,
-                int replace_i, int replace_l,
-                const char *with, int with_l)
+int packet_iov(packet_t *packet, struct iovec **iov_p)
 {
-   int is_data, i;
-   if (data->p == packet->buf.p)
+   /* message with all splices applied as 2 * splices + 1 entries at
+      most, unchanged spans point into the packet buffer, replacements
+      into the splice list, nothing is copied here, valid until the
+      worker handles another message, 0: allocation failed */
+
+   packet_index_t *index = packet_index(packet);
+   uint32_t l = packet->header.len + packet->data.len, i = 0, s;
+   struct iovec *iov = index->iov;
+   int iov_n = 0;
+
+   if (2 * index->splices + 1 > index->iov_allocated)
    {
-      /* replace in header */
-      assert(replace_i + replace_l <= packet->header.len);
-      assert(replace_i + with_l <= packet->header.len);
-      i = replace_i;
-      is_data = 0;
-   }
-   else {
-      /* replace in data */
-      assert(data->p == packet->buf.p + packet->header.len);
-      assert(replace_i + replace_l <= packet->data.len);
-      assert(replace_i + with_l <= packet->data.len);
-      i = replace_i + packet->header.len;
-      is_data = 1;
+      /* sized for the allocated splice list */
+
+      uint32_t allocate = 2 * index->splices_allocated + 1;
+
+      iov = realloc(index->iov, allocate * sizeof(struct iovec));
+      if (iov == NULL)
+      {
+         log_printf(LOG_ERROR, "packet_iov:"
+            " Memory allocation failed (%u bytes)",
+            (unsigned int)(allocate * sizeof(struct iovec)));
+         return 0;
+      }
+
+      index->iov = iov;
+      index->iov_allocated = allocate;
    }
 
-   if (with_l != replace_l || memcmp(data->p + i, with, with_l))
+   /* splices mostly in order, insertion sort by offset */
+
+   for (s = 1; s < index->splices; s++)
    {
-      int l_diff = with_l - replace_l;
-      if (l_diff)
+      splice_t splice = index->splice[s];
+      uint32_t t = s;
+
+      while (t > 0 && index->splice[t - 1].offs > splice.offs)
       {
-         if (!buf_resize(&packet->buf, packet->buf.used + l_diff))
-            return 0;
+         index->splice[t] = index->splice[t - 1];
+         t--;
+      }
 
-         memmove(packet->buf.p + i + with_l,
-                 packet->buf.p + i + replace_l,
-                 packet->buf.used - i - replace_l);
+      index->splice[t] = splice;
+   }
 
-         packet->buf.used += l_diff;
-         if (is_data)
-         {
-            packet->data.len += l_diff;
-            data->p = packet->buf.p + packet->header.len;
-         }
-         else {
-            packet->header.len += l_diff;
-            data->p = packet->buf.p;
-
-            loc_adjust(&packet->via_line, i, replace_l, l_diff);
-            loc_adjust(&packet->via, i, replace_l, l_diff);
-            loc_adjust(&packet->from, i, replace_l, l_diff);
-            loc_adjust(&packet->to, i, replace_l, l_diff);
-            loc_adjust(&packet->contact, i, replace_l, l_diff);
-            loc_adjust(&packet->content_length, i, replace_l, l_diff);
-         }
+   for (s = 0; s < index->splices; s++)
+   {
+      splice_t *splice = index->splice + s;
 
-         if (replace_i + replace_l <= data->i)
-            data->i += l_diff;
-         data->l += l_diff;
+      /* edits do not overlap */
+      assert(splice->offs >= i);
+
+      if (splice->offs > i)
+      {
+         iov[iov_n].iov_base = packet->buf.p + i;
+         iov[iov_n].iov_len = splice->offs - i;
+         iov_n++;
       }
 
-      memcpy(packet->buf.p + i, with, with_l);
+      if (splice->with_l)
+      {
+         iov[iov_n].iov_base = splice->with;
+         iov[iov_n].iov_len = splice->with_l;
+         iov_n++;
+      }
+
+      i = splice->offs + splice->len;
    }
 
-   return 1;
+   if (l > i || iov_n == 0)
+   {
+      iov[iov_n].iov_base = packet->buf.p + i;
+      iov[iov_n].iov_len = l - i;
+      iov_n++;
+   }
+
+   *iov_p = iov;
+   return iov_n;
 }
 
 int addr_find(const data_t *data, int *addr_l_p)
 {
-   int i = data->i;
-   while (i < data->l)
+   uint32_t i = data->i, addr;
+
+   while ((i = digit_next(data->p, i, data->l)) < data->l)
    {
       int addr_l;
-      if (is_addr(data->p + i, data->l - i, &addr_l))
+      if (addr_parse(data->p + i, data->l - i, &addr_l, &addr))
       {
          *addr_l_p = addr_l;
          return i;
@@ -547,6 +1460,29 @@ int addr_find(const data_t *data, int *addr_l_p)
    return -1;
 }
 
+int addr_scan(const data_t *data, addr_pos_t *pos, int pos_max)
+{
+   /* addresses from data->i in one pass, as found by addr_find() */
+
+   uint32_t i = data->i;
+   int n = 0;
+
+   while (n < pos_max && (i = digit_next(data->p, i, data->l)) < data->l)
+   {
+      int addr_l;
+      if (addr_parse(data->p + i, data->l - i, &addr_l, &pos[n].addr))
+      {
+         pos[n].i = i;
+         pos[n].l = addr_l;
+         n++;
+      }
+
+      i += addr_l;
+   }
+
+   return n;
+}
+
 int port_find(const data_t *data, int addr_i, int addr_l, int *port_l_p)
 {
    int i = addr_i + addr_l;
@@ -0,0 +1,250 @@
+/* ------------------------------------------------------------------------
+   (C) 2018 by Roland Genske <roland@genske.org>
+
+   Workaround for FRITZ!App Fon SIP via VPN
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   ------------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------------
+   dependencies
+   ------------------------------------------------------------------------ */
+
+#include "fapfon_proxy.h"
+#include <time.h>
+#include <assert.h>
+
+
+/* ------------------------------------------------------------------------
+   timers
+
+   Hierarchical timing wheel, one per worker, advanced by sfd_wait().
+   Level 0 has one slot per tick, each higher level slot covers a whole
+   lower level and is cascaded into it when the lower level wraps.
+   Timers are kept in doubly linked slot lists, arm and cancel are O(1).
+   Timers already due are kept in a separate list and run without waiting
+   for the next tick.
+   ------------------------------------------------------------------------ */
+
+#define TIMER_TICK_MS    10
+#define TIMER_LEVELS     4
+#define TIMER_SLOT_BITS  8
+#define TIMER_SLOTS      (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK  (TIMER_SLOTS - 1)
+
+/* maximum timeout, keeps tick differences within int32_t */
+#define TIMER_MAX_TICKS  0x7fffffffu
+
+static __thread struct
+{
+   timer_item_t *slot[TIMER_LEVELS][TIMER_SLOTS];
+   timer_item_t *due;            /* expired before next tick */
+   uint32_t next;                /* next tick to process */
+   uint32_t armed;               /* number of armed timers */
+   int started;
+}
+timer_wheel;
+
+static uint64_t timer_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t timer_ticks(void)
+{
+   return (uint32_t)(timer_ms() / TIMER_TICK_MS);
+}
+
+static void timer_start(void)
+{
+   if (!timer_wheel.started)
+   {
+      timer_wheel.next = timer_ticks();
+      timer_wheel.started = 1;
+   }
+}
+
+static void timer_insert(timer_item_t *timer)
+{
+   uint32_t delta;
+   timer_item_t **slot_p;
+   int level = 0;
+
+   if ((int32_t)(timer->expires - timer_wheel.next) < 0)
+   {
+      /* already expired */
+      slot_p = &timer_wheel.due;
+   }
+   else {
+      delta = timer->expires - timer_wheel.next;
+      while (   level < TIMER_LEVELS - 1
+             && delta >= 1u << ((level + 1) * TIMER_SLOT_BITS))
+      {
+         level++;
+      }
+
+      slot_p = timer_wheel.slot[level]
+             + ((timer->expires >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK);
+   }
+
+   timer->next = *slot_p;
+   timer->prev_p = slot_p;
+   if (*slot_p)
+      (*slot_p)->prev_p = &timer->next;
+   *slot_p = timer;
+}
+
+static void timer_unlink(timer_item_t *timer)
+{
+   *timer->prev_p = timer->next;
+   if (timer->next)
+      timer->next->prev_p = timer->prev_p;
+   timer->next = NULL;
+   timer->prev_p = NULL;
+}
+
+static void timer_cascade(int level, int index)
+{
+   timer_item_t *timer = timer_wheel.slot[level][index];
+
+   timer_wheel.slot[level][index] = NULL;
+   while (timer != NULL)
+   {
+      timer_item_t *next = timer->next;
+      timer_insert(timer);
+      timer = next;
+   }
+}
+
+void timer_init(timer_item_t *timer, timer_cb_t cb, void *context)
+{
+   timer->next = NULL;
+   timer->prev_p = NULL;
+   timer->expires = 0;
+   timer->cb = cb;
+   timer->context = context;
+}
+
+void timer_arm(timer_item_t *timer, uint32_t timeout_ms)
+{
+   uint32_t ticks = (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+   timer_start();
+   if (timer->prev_p)
+      timer_unlink(timer);
+   else
+      timer_wheel.armed++;
+
+   if (ticks > TIMER_MAX_TICKS)
+      ticks = TIMER_MAX_TICKS;
+
+   timer->expires = timer_ticks() + ticks;
+   timer_insert(timer);
+}
+
+void timer_cancel(timer_item_t *timer)
+{
+   if (timer->prev_p)
+   {
+      timer_unlink(timer);
+
+      assert(timer_wheel.armed > 0);
+      timer_wheel.armed--;
+   }
+}
+
+int timer_timeout(void)
+{
+   uint32_t index, tick;
+   uint64_t now_ms;
+   int32_t ticks;
+
+   if (timer_wheel.armed == 0)
+      return -1;
+   if (timer_wheel.due != NULL)
+      return 0;
+
+   /* first armed slot in level 0, else wake up to cascade */
+
+   for (index = timer_wheel.next & TIMER_SLOT_MASK;
+        index < TIMER_SLOTS && timer_wheel.slot[0][index] == NULL;
+        index++)
+   {
+      ;
+   }
+
+   tick = (timer_wheel.next & ~TIMER_SLOT_MASK) + index;
+
+   now_ms = timer_ms();
+   ticks = (int32_t)(tick - (uint32_t)(now_ms / TIMER_TICK_MS));
+   if (ticks <= 0)
+      return 0;
+
+   return ticks * TIMER_TICK_MS - (int)(now_ms % TIMER_TICK_MS);
+}
+
+void timer_run(void)
+{
+   timer_item_t *due = timer_wheel.due, *timer;
+   uint32_t now;
+
+   if (due != NULL)
+   {
+      /* timers armed due by callbacks run with the next call */
+
+      timer_wheel.due = NULL;
+      due->prev_p = &due;
+
+      while ((timer = due) != NULL)
+      {
+         timer_unlink(timer);
+         timer_wheel.armed--;
+
+         timer->cb(timer->context);
+      }
+   }
+
+   if (timer_wheel.armed == 0)
+   {
+      timer_wheel.started = 0;
+      return;
+   }
+
+   now = timer_ticks();
+   while ((int32_t)(now - timer_wheel.next) >= 0)
+   {
+      uint32_t tick = timer_wheel.next;
+      int index = tick & TIMER_SLOT_MASK, level;
+
+      for (level = 1; index == 0 && level < TIMER_LEVELS; level++)
+      {
+         int i = (tick >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK;
+         timer_cascade(level, i);
+         if (i != 0)
+            break;
+      }
+
+      /* timers armed by callbacks are inserted after this tick */
+      timer_wheel.next++;
+
+      while ((timer = timer_wheel.slot[0][index]) != NULL)
+      {
+         timer_unlink(timer);
+         timer_wheel.armed--;
+
+         timer->cb(timer->context);
+      }
+
+      if (timer_wheel.armed == 0)
+      {
+         timer_wheel.started = 0;
+         break;
+      }
+   }
+}
@@ -0,0 +1,1166 @@
+/* ------------------------------------------------------------------------
+   (C) 2018 by Roland Genske <roland@genske.org>
+
+   Workaround for FRITZ!App Fon SIP via VPN
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   ------------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------------
+   dependencies
+   ------------------------------------------------------------------------ */
+
+#include "fapfon_proxy.h"
+
+#if defined(HAVE_IO_URING)
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <assert.h>
+#include <errno.h>
+
+
+/* ------------------------------------------------------------------------
+   io_uring event engine
+
+   TCP listen sockets use multishot accept, connected TCP and UDP sockets
+   use multishot receive into a provided buffer ring. Received data is
+   kept per socket until the event callback fetches it with
+   sfd_receive(), so no further syscalls are needed.
+   The unconnected UDP server socket is polled, its datagrams are read
+   with recvmsg() to get the local address.
+
+   Transmitted data is copied and queued per socket, one send is in
+   flight per socket. All requests are submitted in one batch when
+   waiting for the next events. Paused sockets have their receive
+   request cancelled, received data is kept until resumed.
+   ------------------------------------------------------------------------ */
+
+#define URING_ENTRIES     256
+#define URING_CQ_ENTRIES  4096
+#define URING_BUF_COUNT   64             /* power of 2 */
+#define URING_BUF_SIZE    (16 * 1024)
+#define URING_BUF_GROUP   0
+
+/* user_data: bits 0-1 operation, send request pointer
+   or bits 2-31 socket descriptor, bits 32-63 generation */
+
+enum uring_op_t
+{
+   OP_SEND   = 0,
+   OP_ACCEPT = 1,
+   OP_RECV   = 2,
+   OP_POLL   = 3
+};
+
+#define URING_OP_MASK 3
+
+enum uring_kind_t
+{
+   KIND_STREAM,                  /* connected TCP socket */
+   KIND_DGRAM,                   /* connected UDP socket */
+   KIND_LISTEN,                  /* TCP listen socket */
+   KIND_POLL                     /* unconnected UDP socket */
+};
+
+typedef struct uring_send
+{
+   struct uring_send *next;
+   int sfd;
+   uint32_t generation;
+   uint32_t offs, len;
+   char data[];
+}
+uring_send_t;
+
+typedef struct
+{
+   void *context;
+   uint32_t generation;
+   enum uring_kind_t kind;
+   int registered, armed, starved, ready, eof, error;
+   int paused, write_ready;
+
+   int rbuf_head, rbuf_tail;     /* received buffers, -1: none */
+   uint32_t available;
+
+   int *accepted;
+   int accepted_n, accepted_allocated;
+
+   uring_send_t *send_head, *send_tail;
+   int send_inflight;
+   uint32_t send_queued;         /* bytes in transmit queue */
+   int send_high;                /* high-water mark exceeded */
+}
+uring_item_t;
+
+static __thread struct
+{
+   int ring_fd;
+
+   struct
+   {
+      unsigned *head, *tail, *array;
+      unsigned mask, entries, local_tail;
+      struct io_uring_sqe *sqes;
+   }
+   sq;
+
+   struct
+   {
+      unsigned *head, *tail;
+      unsigned mask;
+      struct io_uring_cqe *cqes;
+   }
+   cq;
+
+   struct io_uring_buf_ring *buf_ring;
+   char *buf;
+   uint16_t buf_tail;
+   int buf_next[URING_BUF_COUNT];
+   uint32_t buf_offs[URING_BUF_COUNT], buf_len[URING_BUF_COUNT];
+
+   uring_item_t *item;           /* indexed by socket descriptor */
+   int allocated;
+   uint32_t generation;
+
+   int *ready;                   /* socket descriptors with events */
+   uint32_t *ready_generation;
+   int ready_n, ready_allocated;
+
+   int starved_n;                /* receive waiting for buffers */
+}
+uring = { .ring_fd = -1 };
+
+#define URING_ITEM_INCREMENT 64
+
+
+/* ------------------------------------------------------------------------
+   ring setup
+   ------------------------------------------------------------------------ */
+
+static int uring_mmap(void **p_p, size_t size, off_t offset)
+{
+   *p_p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, uring.ring_fd, offset);
+   if (*p_p == MAP_FAILED)
+   {
+      int err_no = errno;
+      log_printf(LOG_ERROR, "uring_init: "
+         "mmap [%d] %s", err_no, strerror(err_no));
+      return 0;
+   }
+
+   return 1;
+}
+
+int uring_init(void)
+{
+   struct io_uring_params params;
+   struct io_uring_buf_reg reg;
+   size_t sq_size, cq_size, buf_ring_size;
+   void *sq_p, *cq_p, *sqes_p;
+   int i;
+
+   if (uring.ring_fd != -1)
+      return 1;
+
+   memset(&params, 0, sizeof(params));
+   params.flags = IORING_SETUP_CQSIZE;
+   params.cq_entries = URING_CQ_ENTRIES;
+
+   uring.ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+   if (uring.ring_fd == -1)
+   {
+      int err_no = errno;
+      log_printf(LOG_ERROR, "uring_init: "
+         "io_uring_setup [%d] %s", err_no, strerror(err_no));
+      return 0;
+   }
+
+   sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   cq_size = params.cq_off.cqes
+           + params.cq_entries * sizeof(struct io_uring_cqe);
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      if (cq_size > sq_size)
+         sq_size = cq_size;
+   }
+
+   if (!uring_mmap(&sq_p, sq_size, IORING_OFF_SQ_RING))
+      return 0;
+
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+      cq_p = sq_p;
+   else if (!uring_mmap(&cq_p, cq_size, IORING_OFF_CQ_RING))
+      return 0;
+
+   if (!uring_mmap(&sqes_p, params.sq_entries * sizeof(struct io_uring_sqe),
+                   IORING_OFF_SQES))
+   {
+      return 0;
+   }
+
+   uring.sq.head = (unsigned *)((char *)sq_p + params.sq_off.head);
+   uring.sq.tail = (unsigned *)((char *)sq_p + params.sq_off.tail);
+   uring.sq.array = (unsigned *)((char *)sq_p + params.sq_off.array);
+   uring.sq.mask = *(unsigned *)((char *)sq_p + params.sq_off.ring_mask);
+   uring.sq.entries = params.sq_entries;
+   uring.sq.local_tail = *uring.sq.tail;
+   uring.sq.sqes = sqes_p;
+
+   uring.cq.head = (unsigned *)((char *)cq_p + params.cq_off.head);
+   uring.cq.tail = (unsigned *)((char *)cq_p + params.cq_off.tail);
+   uring.cq.mask = *(unsigned *)((char *)cq_p + params.cq_off.ring_mask);
+   uring.cq.cqes = (struct io_uring_cqe *)((char *)cq_p
+                                           + params.cq_off.cqes);
+
+   /* provided buffer ring for multishot receive */
+
+   buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+   uring.buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (uring.buf_ring == MAP_FAILED)
+   {
+      int err_no = errno;
+      log_printf(LOG_ERROR, "uring_init: "
+         "mmap [%d] %s", err_no, strerror(err_no));
+      return 0;
+   }
+
+   uring.buf = malloc(URING_BUF_COUNT * URING_BUF_SIZE);
+   if (uring.buf == NULL)
+   {
+      log_printf(LOG_ERROR, "uring_init:"
+         " Memory allocation failed (%u bytes)",
+         URING_BUF_COUNT * URING_BUF_SIZE);
+      return 0;
+   }
+
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (uint64_t)(uintptr_t)uring.buf_ring;
+   reg.ring_entries = URING_BUF_COUNT;
+   reg.bgid = URING_BUF_GROUP;
+
+   if (syscall(__NR_io_uring_register, uring.ring_fd,
+               IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+   {
+      int err_no = errno;
+      log_printf(LOG_ERROR, "uring_init: "
+         "io_uring_register(IORING_REGISTER_PBUF_RING) [%d] %s",
+         err_no, strerror(err_no));
+      return 0;
+   }
+
+   for (i = 0; i < URING_BUF_COUNT; i++)
+   {
+      struct io_uring_buf *buf = uring.buf_ring->bufs + i;
+
+      buf->addr = (uint64_t)(uintptr_t)(uring.buf + i * URING_BUF_SIZE);
+      buf->len = URING_BUF_SIZE;
+      buf->bid = i;
+   }
+
+   uring.buf_tail = URING_BUF_COUNT;
+   __atomic_store_n(&uring.buf_ring->tail, uring.buf_tail, __ATOMIC_RELEASE);
+
+   return 1;
+}
+
+
+/* ------------------------------------------------------------------------
+   submission queue
+   ------------------------------------------------------------------------ */
+
+static int uring_enter(unsigned wait_nr, int timeout)
+{
+   struct __kernel_timespec ts;
+   struct io_uring_getevents_arg arg;
+   unsigned flags = 0;
+
+   if (wait_nr)
+      flags |= IORING_ENTER_GETEVENTS;
+
+   if (wait_nr && timeout >= 0)
+   {
+      /* provided buffer rings imply IORING_FEAT_EXT_ARG (Linux 5.11) */
+
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+
+      memset(&arg, 0, sizeof(arg));
+      arg.ts = (uint64_t)(uintptr_t)&ts;
+      flags |= IORING_ENTER_EXT_ARG;
+   }
+
+   for (;;)
+   {
+      unsigned to_submit;
+
+      __atomic_store_n(uring.sq.tail, uring.sq.local_tail, __ATOMIC_RELEASE);
+      to_submit = uring.sq.local_tail
+                - __atomic_load_n(uring.sq.head, __ATOMIC_ACQUIRE);
+
+      if (to_submit == 0 && wait_nr == 0)
+         return 1;
+
+      if (syscall(__NR_io_uring_enter, uring.ring_fd, to_submit, wait_nr,
+                  flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+                  (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0) == -1)
+      {
+         int err_no = errno;
+         if (err_no == EINTR)
+            continue;
+
+         if (err_no == ETIME)
+         {
+            /* timer expired */
+            return 1;
+         }
+
+         if (err_no == EBUSY || err_no == EAGAIN)
+         {
+            /* completion queue busy, process completions first */
+            return 1;
+         }
+
+         log_printf(LOG_ERROR, "uring_enter: "
+            "io_uring_enter [%d] %s", err_no, strerror(err_no));
+         return 0;
+      }
+
+      return 1;
+   }
+}
+
+static struct io_uring_sqe *uring_sqe(void)
+{
+   /* NULL: submission queue full and not consumed by the kernel,
+      e.g. EBUSY until completions are processed */
+
+   struct io_uring_sqe *sqe;
+   unsigned index, head;
+
+   while (   uring.sq.local_tail
+           - (head = __atomic_load_n(uring.sq.head, __ATOMIC_ACQUIRE))
+          >= uring.sq.entries)
+   {
+      /* submission queue full, submit now */
+
+      if (   !uring_enter(0, -1)
+          || __atomic_load_n(uring.sq.head, __ATOMIC_ACQUIRE) == head)
+      {
+         log_printf(LOG_ERROR, "uring_sqe: Submission queue full");
+         return NULL;
+      }
+   }
+
+   index = uring.sq.local_tail & uring.sq.mask;
+   sqe = uring.sq.sqes + index;
+   memset(sqe, 0, sizeof(*sqe));
+
+   uring.sq.array[index] = index;
+   uring.sq.local_tail++;
+   return sqe;
+}
+
+static uint64_t uring_user_data(int sfd, enum uring_op_t op)
+{
+   return   (uint64_t)uring.item[sfd].generation << 32
+          | (uint64_t)(uint32_t)sfd << 2 | op;
+}
+
+static void uring_arm(int sfd)
+{
+   uring_item_t *item = uring.item + sfd;
+   struct io_uring_sqe *sqe = uring_sqe();
+
+   if (sqe == NULL)
+   {
+      /* re-armed after the next wait, like receives out of buffers */
+      item->armed = 0;
+      if (!item->starved)
+      {
+         item->starved = 1;
+         uring.starved_n++;
+      }
+      return;
+   }
+
+   sqe->fd = sfd;
+   switch (item->kind)
+   {
+      case KIND_STREAM:
+      case KIND_DGRAM:
+         sqe->opcode = IORING_OP_RECV;
+         sqe->ioprio = IORING_RECV_MULTISHOT;
+         sqe->flags = IOSQE_BUFFER_SELECT;
+         sqe->buf_group = URING_BUF_GROUP;
+         sqe->user_data = uring_user_data(sfd, OP_RECV);
+         break;
+
+      case KIND_LISTEN:
+         sqe->opcode = IORING_OP_ACCEPT;
+         sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+         sqe->accept_flags = SOCK_NONBLOCK;
+         sqe->user_data = uring_user_data(sfd, OP_ACCEPT);
+         break;
+
+      case KIND_POLL:
+         sqe->opcode = IORING_OP_POLL_ADD;
+         sqe->poll32_events = POLLIN;
+         sqe->user_data = uring_user_data(sfd, OP_POLL);
+         break;
+   }
+
+   item->armed = 1;
+   if (item->starved)
+   {
+      item->starved = 0;
+      uring.starved_n--;
+   }
+}
+
+static void uring_cancel(uint64_t user_data)
+{
+   struct io_uring_sqe *sqe = uring_sqe();
+
+   if (sqe == NULL)
+   {
+      /* request ends when the socket is closed */
+      return;
+   }
+
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->addr = user_data;
+   sqe->user_data = 0;           /* completion ignored */
+}
+
+static int uring_send_submit(uring_send_t *send)
+{
+   struct io_uring_sqe *sqe = uring_sqe();
+
+   if (sqe == NULL)
+      return 0;
+
+   sqe->opcode = IORING_OP_SEND;
+   sqe->fd = send->sfd;
+   sqe->addr = (uint64_t)(uintptr_t)(send->data + send->offs);
+   sqe->len = send->len - send->offs;
+   sqe->msg_flags = MSG_NOSIGNAL;
+   if (uring.item[send->sfd].kind == KIND_STREAM)
+      sqe->msg_flags |= MSG_WAITALL;
+   sqe->user_data = (uint64_t)(uintptr_t)send;
+   return 1;
+}
+
+
+/* ------------------------------------------------------------------------
+   provided receive buffers
+   ------------------------------------------------------------------------ */
+
+static void uring_buf_recycle(int bid)
+{
+   struct io_uring_buf *buf;
+
+   buf = uring.buf_ring->bufs + (uring.buf_tail & (URING_BUF_COUNT - 1));
+   buf->addr = (uint64_t)(uintptr_t)(uring.buf + bid * URING_BUF_SIZE);
+   buf->len = URING_BUF_SIZE;
+   buf->bid = bid;
+
+   uring.buf_tail++;
+   __atomic_store_n(&uring.buf_ring->tail, uring.buf_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_buf_pop(uring_item_t *item)
+{
+   int bid = item->rbuf_head;
+
+   item->rbuf_head = uring.buf_next[bid];
+   if (item->rbuf_head == -1)
+      item->rbuf_tail = -1;
+
+   uring_buf_recycle(bid);
+   return bid;
+}
+
+
+/* ------------------------------------------------------------------------
+   transmit queue
+   ------------------------------------------------------------------------ */
+
+static void uring_send_free(uring_item_t *item)
+{
+   uring_send_t *send = item->send_head;
+
+   if (send != NULL && item->send_inflight)
+   {
+      /* released on completion */
+      uring_cancel((uint64_t)(uintptr_t)send);
+      send = send->next;
+   }
+
+   while (send != NULL)
+   {
+      uring_send_t *next = send->next;
+      free(send);
+      send = next;
+   }
+
+   item->send_head = item->send_tail = NULL;
+   item->send_inflight = 0;
+   item->send_queued = 0;
+   item->send_high = 0;
+}
+
+
+/* ------------------------------------------------------------------------
+   socket registration
+   ------------------------------------------------------------------------ */
+
+int uring_register(int sfd, void *context)
+{
+   uring_item_t *item;
+   int32_t sock_opt;
+   socklen_t sock_opt_l;
+
+   if (sfd >= uring.allocated)
+   {
+      /* multiple of URING_ITEM_INCREMENT > sfd */
+      int allocate = (  (sfd + URING_ITEM_INCREMENT)
+                      / URING_ITEM_INCREMENT) * URING_ITEM_INCREMENT;
+      int *ready;
+      uint32_t *ready_generation;
+
+      item = realloc(uring.item, allocate * sizeof(uring_item_t));
+      if (item == NULL)
+      {
+         log_printf(LOG_ERROR, "uring_register:"
+            " Memory allocation failed (%u bytes)",
+            (unsigned int)(allocate * sizeof(uring_item_t)));
+         return 0;
+      }
+
+      memset(item + uring.allocated, 0,
+             (allocate - uring.allocated) * sizeof(uring_item_t));
+      uring.item = item;
+      uring.allocated = allocate;
+
+      ready = realloc(uring.ready, allocate * sizeof(int));
+      if (ready == NULL)
+      {
+         log_printf(LOG_ERROR, "uring_register:"
+            " Memory allocation failed (%u bytes)",
+            (unsigned int)(allocate * sizeof(int)));
+         return 0;
+      }
+      uring.ready = ready;
+
+      ready_generation = realloc(uring.ready_generation,
+                                 allocate * sizeof(uint32_t));
+      if (ready_generation == NULL)
+      {
+         log_printf(LOG_ERROR, "uring_register:"
+            " Memory allocation failed (%u bytes)",
+            (unsigned int)(allocate * sizeof(uint32_t)));
+         return 0;
+      }
+      uring.ready_generation = ready_generation;
+
+      uring.ready_allocated = allocate;
+   }
+
+   item = uring.item + sfd;
+   assert(!item->registered);
+
+   sock_opt_l = sizeof(sock_opt);
+   if (getsockopt(sfd, SOL_SOCKET, SO_TYPE, &sock_opt, &sock_opt_l) == -1)
+   {
+      int err_no = errno;
+      if (err_no != ENOTSOCK)
+      {
+         log_printf(LOG_ERROR, "uring_register: "
+            "getsockopt(SOL_SOCKET,SO_TYPE) [%d] %s",
+            err_no, strerror(err_no));
+         return 0;
+      }
+
+      /* not a socket, e.g. worker inbox eventfd */
+      item->kind = KIND_POLL;
+   }
+   else if (sock_opt == SOCK_STREAM)
+   {
+      sock_opt_l = sizeof(sock_opt);
+      if (   getsockopt(sfd, SOL_SOCKET, SO_ACCEPTCONN,
+                        &sock_opt, &sock_opt_l) == 0
+          && sock_opt)
+      {
+         item->kind = KIND_LISTEN;
+      }
+      else
+         item->kind = KIND_STREAM;
+   }
+   else {
+      struct sockaddr_storage sock_addr;
+      socklen_t sock_addr_l = sizeof(sock_addr);
+
+      if (getpeername(sfd, (void *)&sock_addr, &sock_addr_l) == 0)
+         item->kind = KIND_DGRAM;
+      else
+         item->kind = KIND_POLL;
+   }
+
+   item->context = context;
+   item->generation = ++uring.generation;
+   item->registered = 1;
+   item->ready = item->eof = item->error = 0;
+   item->paused = item->write_ready = 0;
+   item->rbuf_head = item->rbuf_tail = -1;
+   item->available = 0;
+   item->accepted_n = 0;
+   item->send_head = item->send_tail = NULL;
+   item->send_inflight = 0;
+   item->send_queued = 0;
+   item->send_high = 0;
+
+   uring_arm(sfd);
+   return 1;
+}
+
+void uring_unregister(int sfd)
+{
+   uring_item_t *item;
+
+   if (sfd >= uring.allocated || !uring.item[sfd].registered)
+      return;
+
+   item = uring.item + sfd;
+   item->registered = 0;
+
+   if (item->armed)
+   {
+      uring_cancel(uring_user_data(sfd,
+                      item->kind == KIND_LISTEN ? OP_ACCEPT :
+                      item->kind == KIND_POLL   ? OP_POLL   : OP_RECV));
+      item->armed = 0;
+   }
+
+   while (item->rbuf_head != -1)
+      uring_buf_pop(item);
+   item->available = 0;
+
+   while (item->accepted_n)
+      close(item->accepted[--item->accepted_n]);
+
+   uring_send_free(item);
+}
+
+
+/* ------------------------------------------------------------------------
+   process completions, notify events
+   ------------------------------------------------------------------------ */
+
+static void uring_ready(int sfd)
+{
+   uring_item_t *item = uring.item + sfd;
+
+   if (!item->ready)
+   {
+      item->ready = 1;
+      uring.ready[uring.ready_n] = sfd;
+      uring.ready_generation[uring.ready_n] = item->generation;
+      uring.ready_n++;
+   }
+}
+
+static void uring_send_error(uring_item_t *item, int sfd)
+{
+   /* transmit queue dropped, reported as SFD_EVENT_ERROR */
+
+   item->send_inflight = 0;
+   uring_send_free(item);
+
+   item->error = 1;
+   uring_ready(sfd);
+}
+
+static void uring_send_complete(uring_send_t *send, int res)
+{
+   uring_item_t *item = uring.item + send->sfd;
+
+   if (   send->sfd >= uring.allocated
+       || !item->registered
+       || item->generation != send->generation
+       || item->send_head != send)
+   {
+      /* socket no longer registered */
+      free(send);
+      return;
+   }
+
+   assert(item->send_inflight);
+
+   if (res < 0)
+   {
+      log_printf(LOG_DETAIL, "Failed to send data [%d] %s",
+         -res, strerror(-res));
+
+      item->send_head = send->next;
+      uring_send_error(item, send->sfd);
+      free(send);
+      return;
+   }
+
+   send->offs += res;
+   if (send->offs < send->len && item->kind == KIND_STREAM)
+   {
+      /* still queued, released by uring_send_error() on failure */
+      if (!uring_send_submit(send))
+         uring_send_error(item, send->sfd);
+      return;
+   }
+
+   item->send_head = send->next;
+   if (item->send_head == NULL)
+      item->send_tail = NULL;
+   item->send_queued -= send->len;
+
+   if (item->send_head == NULL)
+      item->send_inflight = 0;
+   else if (!uring_send_submit(item->send_head))
+      uring_send_error(item, send->sfd);
+
+   if (item->send_high && item->send_queued <= SFD_QUEUE_LOW_WATER)
+   {
+      /* notify SFD_EVENT_WRITE */
+      item->send_high = 0;
+      item->write_ready = 1;
+      uring_ready(send->sfd);
+   }
+
+   free(send);
+}
+
+static void uring_complete(const struct io_uring_cqe *cqe)
+{
+   enum uring_op_t op = cqe->user_data & URING_OP_MASK;
+   uring_item_t *item;
+   int sfd, more;
+
+   if (op == OP_SEND)
+   {
+      if (cqe->user_data)
+         uring_send_complete((void *)(uintptr_t)cqe->user_data, cqe->res);
+      return;
+   }
+
+   sfd = (int)((cqe->user_data >> 2) & 0x3fffffff);
+   item = uring.item + sfd;
+
+   if (   sfd >= uring.allocated
+       || !item->registered
+       || item->generation != (uint32_t)(cqe->user_data >> 32))
+   {
+      /* socket no longer registered */
+
+      if (op == OP_RECV && (cqe->flags & IORING_CQE_F_BUFFER))
+         uring_buf_recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      else if (op == OP_ACCEPT && cqe->res >= 0)
+         close(cqe->res);
+      return;
+   }
+
+   more = cqe->flags & IORING_CQE_F_MORE;
+
+   switch (op)
+   {
+      case OP_ACCEPT:
+         if (cqe->res >= 0)
+         {
+            if (item->accepted_n == item->accepted_allocated)
+            {
+               int allocate = item->accepted_allocated + 16;
+               int *accepted = realloc(item->accepted,
+                                       allocate * sizeof(int));
+               if (accepted == NULL)
+               {
+                  log_printf(LOG_ERROR, "uring_complete:"
+                     " Memory allocation failed (%u bytes)",
+                     (unsigned int)(allocate * sizeof(int)));
+                  close(cqe->res);
+                  break;
+               }
+
+               item->accepted = accepted;
+               item->accepted_allocated = allocate;
+            }
+
+            item->accepted[item->accepted_n++] = cqe->res;
+            uring_ready(sfd);
+         }
+         else {
+            log_printf(LOG_ERROR, "uring_complete: "
+               "Failed to accept connection [%d] %s",
+               -cqe->res, strerror(-cqe->res));
+         }
+         break;
+
+      case OP_RECV:
+         if (cqe->res > 0)
+         {
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            assert(cqe->flags & IORING_CQE_F_BUFFER);
+            uring.buf_offs[bid] = 0;
+            uring.buf_len[bid] = cqe->res;
+            uring.buf_next[bid] = -1;
+
+            if (item->rbuf_tail == -1)
+               item->rbuf_head = bid;
+            else
+               uring.buf_next[item->rbuf_tail] = bid;
+            item->rbuf_tail = bid;
+
+            item->available += cqe->res;
+            uring_ready(sfd);
+         }
+         else if (cqe->res == 0)
+         {
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+               uring_buf_recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+            if (item->kind == KIND_STREAM)
+            {
+               /* connection closed by peer */
+               item->eof = 1;
+               uring_ready(sfd);
+               more = 1;
+            }
+         }
+         else if (cqe->res == -ECANCELED)
+         {
+            /* cancelled by uring_pause() */
+         }
+         else if (cqe->res == -ENOBUFS)
+         {
+            /* re-armed when buffers have been processed */
+            item->armed = 0;
+            item->starved = 1;
+            uring.starved_n++;
+            return;
+         }
+         else {
+            log_printf(LOG_DETAIL, "Failed to receive data [%d] %s",
+               -cqe->res, strerror(-cqe->res));
+            item->error = 1;
+            uring_ready(sfd);
+            more = 1;
+         }
+         break;
+
+      case OP_POLL:
+         /* single shot, re-armed after notification */
+         item->armed = 0;
+         uring_ready(sfd);
+         return;
+
+      default:
+         assert(0);
+   }
+
+   if (!more)
+   {
+      /* multishot request terminated, re-armed unless paused */
+      item->armed = 0;
+      if (!item->paused)
+         uring_arm(sfd);
+   }
+}
+
+int uring_wait(sfd_callback_t cb, int timeout)
+{
+   unsigned head, tail;
+   int i;
+
+   /* sockets made ready outside of completion processing, e.g. by
+      sfd_pause() from a timer callback, are notified without waiting */
+
+   if (!uring_enter(uring.ready_n ? 0 : 1, timeout))
+      return 0;
+
+   head = *uring.cq.head;
+   tail = __atomic_load_n(uring.cq.tail, __ATOMIC_ACQUIRE);
+
+   while (head != tail)
+   {
+      uring_complete(uring.cq.cqes + (head & uring.cq.mask));
+      head++;
+   }
+
+   __atomic_store_n(uring.cq.head, head, __ATOMIC_RELEASE);
+
+   for (i = 0; i < uring.ready_n; i++)
+   {
+      int sfd = uring.ready[i];
+      uint32_t generation = uring.ready_generation[i];
+      uring_item_t *item = uring.item + sfd;
+
+      if (!item->registered || item->generation != generation)
+         continue;
+
+      item->ready = 0;
+      if (item->error)
+      {
+         cb(sfd, item->context, SFD_EVENT_ERROR);
+         continue;
+      }
+
+      if (item->write_ready)
+      {
+         item->write_ready = 0;
+         cb(sfd, item->context, SFD_EVENT_WRITE);
+
+         item = uring.item + sfd;
+         if (!item->registered || item->generation != generation)
+            continue;
+      }
+
+      switch (item->kind)
+      {
+         case KIND_STREAM:
+         case KIND_DGRAM:
+         case KIND_LISTEN:
+            for (;;)
+            {
+               /* notify until all received data is processed */
+
+               uint32_t available = item->available;
+               int accepted_n = item->accepted_n, eof = item->eof;
+
+               if (   (available == 0 && accepted_n == 0 && !eof)
+                   || item->paused)
+               {
+                  break;
+               }
+
+               cb(sfd, item->context, SFD_EVENT_DATA);
+
+               item = uring.item + sfd;
+               if (   !item->registered
+                   || item->generation != generation
+                   || (   item->available == available
+                       && item->accepted_n == accepted_n))
+               {
+                  break;
+               }
+            }
+            break;
+
+         case KIND_POLL:
+            cb(sfd, item->context, SFD_EVENT_DATA);
+
+            item = uring.item + sfd;
+            if (item->registered && item->generation == generation)
+               uring_arm(sfd);
+            break;
+      }
+   }
+
+   uring.ready_n = 0;
+
+   for (i = 0; uring.starved_n && i < uring.allocated; i++)
+   {
+      if (uring.item[i].starved)
+      {
+         if (uring.item[i].registered && !uring.item[i].paused)
+            uring_arm(i);
+         else {
+            uring.item[i].starved = 0;
+            uring.starved_n--;
+         }
+      }
+   }
+
+   return 1;
+}
+
+
+/* ------------------------------------------------------------------------
+   accept, receive and transmit
+   ------------------------------------------------------------------------ */
+
+int uring_accept(int listen_sfd)
+{
+   uring_item_t *item = uring.item + listen_sfd;
+   int sfd;
+
+   if (   listen_sfd >= uring.allocated
+       || !item->registered
+       || item->accepted_n == 0)
+   {
+      return -1;
+   }
+
+   sfd = item->accepted[0];
+   memmove(item->accepted, item->accepted + 1,
+           --item->accepted_n * sizeof(int));
+   return sfd;
+}
+
+int uring_receive(int sfd, void *data_p, uint32_t *data_l_p)
+{
+   uring_item_t *item = uring.item + sfd;
+   uint32_t data_l = *data_l_p;
+   char *p = data_p;
+
+   if (   sfd >= uring.allocated
+       || !item->registered
+       || (item->kind != KIND_STREAM && item->kind != KIND_DGRAM))
+   {
+      return 0;
+   }
+
+   while (data_l && item->rbuf_head != -1)
+   {
+      int bid = item->rbuf_head;
+      uint32_t l = uring.buf_len[bid] - uring.buf_offs[bid];
+
+      if (l > data_l)
+         l = data_l;
+
+      memcpy(p, uring.buf + bid * URING_BUF_SIZE + uring.buf_offs[bid], l);
+      p += l;
+      data_l -= l;
+
+      uring.buf_offs[bid] += l;
+      item->available -= l;
+
+      if (item->kind == KIND_DGRAM)
+      {
+         /* one datagram per receive, excess data discarded */
+         item->available -= uring.buf_len[bid] - uring.buf_offs[bid];
+         uring_buf_pop(item);
+         break;
+      }
+
+      if (uring.buf_offs[bid] == uring.buf_len[bid])
+         uring_buf_pop(item);
+   }
+
+   *data_l_p = p - (char *)data_p;
+   if (*data_l_p == 0 && item->eof)
+      return 2;
+
+   return 1;
+}
+
+int uring_transmit(int sfd, const struct iovec *iov, int iov_n)
+{
+   /* gathered into the queue, sent asynchronously */
+
+   uring_item_t *item = uring.item + sfd;
+   uring_send_t *send;
+   uint32_t data_l = 0;
+   char *p;
+   int i;
+
+   if (sfd >= uring.allocated || !item->registered)
+      return 0;
+
+   if (item->error)
+      return 0;
+
+   for (i = 0; i < iov_n; i++)
+      data_l += iov[i].iov_len;
+
+   send = malloc(sizeof(uring_send_t) + data_l);
+   if (send == NULL)
+   {
+      log_printf(LOG_ERROR, "uring_transmit:"
+         " Memory allocation failed (%u bytes)",
+         (unsigned int)(sizeof(uring_send_t) + data_l));
+      return 0;
+   }
+
+   send->next = NULL;
+   send->sfd = sfd;
+   send->generation = item->generation;
+   send->offs = 0;
+   send->len = data_l;
+
+   for (p = send->data, i = 0; i < iov_n; i++)
+   {
+      memcpy(p, iov[i].iov_base, iov[i].iov_len);
+      p += iov[i].iov_len;
+   }
+
+   if (item->send_tail == NULL)
+      item->send_head = send;
+   else
+      item->send_tail->next = send;
+   item->send_tail = send;
+
+   if (!item->send_inflight)
+   {
+      item->send_inflight = 1;
+      if (!uring_send_submit(send))
+      {
+         uring_send_error(item, sfd);
+         return 0;
+      }
+   }
+
+   item->send_queued += data_l;
+   if (item->send_queued > SFD_QUEUE_HIGH_WATER)
+   {
+      item->send_high = 1;
+      return 2;
+   }
+
+   return 1;
+}
+
+void uring_pause(int sfd, int pause)
+{
+   uring_item_t *item = uring.item + sfd;
+
+   if (   sfd >= uring.allocated
+       || !item->registered
+       || (item->kind != KIND_STREAM && item->kind != KIND_DGRAM))
+   {
+      return;
+   }
+
+   item->paused = pause;
+   if (pause)
+   {
+      /* stop receiving, keep provided buffers for other sockets */
+
+      if (item->armed)
+         uring_cancel(uring_user_data(sfd, OP_RECV));
+      if (item->starved)
+      {
+         item->starved = 0;
+         uring.starved_n--;
+      }
+   }
+   else {
+      if (!item->armed)
+         uring_arm(sfd);
+
+      /* notify data received before pausing */
+      if (item->available || item->eof)
+         uring_ready(sfd);
+   }
+}
+
+#endif /* HAVE_IO_URING */
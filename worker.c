@@ -0,0 +1,451 @@
+/* ------------------------------------------------------------------------
+   (C) 2018 by Roland Genske <roland@genske.org>
+
+   Workaround for FRITZ!App Fon SIP via VPN
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   ------------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------------
+   dependencies
+   ------------------------------------------------------------------------ */
+
+#include "fapfon_proxy.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <assert.h>
+#include <errno.h>
+
+
+/* ------------------------------------------------------------------------
+   contact registry
+
+   Maps contact identifiers (case insensitive) to the owning worker and
+   client, shared by all workers. Open addressing with linear probing,
+   deleted entries are marked and reused.
+   ------------------------------------------------------------------------ */
+
+#define CONTACT_TABLE_MIN 256
+
+typedef struct
+{
+   char *id;                     /* NULL: free, contact_deleted: deleted */
+   uint16_t id_l;
+   uint32_t hash;
+   contact_t contact;
+}
+contact_entry_t;
+
+static char contact_deleted[1];
+
+static struct
+{
+   pthread_mutex_t mutex;
+   contact_entry_t *entry;
+   uint32_t allocated, used, deleted;
+}
+contact_table = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t contact_hash(const char *id, int id_l)
+{
+   /* FNV-1a, ASCII lowercase */
+
+   uint32_t hash = 2166136261u;
+   int i;
+
+   for (i = 0; i < id_l; i++)
+   {
+      unsigned char c = id[i];
+      if (c >= 'A' && c <= 'Z')
+         c += 'a' - 'A';
+      hash = (hash ^ c) * 16777619u;
+   }
+
+   return hash;
+}
+
+static contact_entry_t *contact_find(const char *id, int id_l, uint32_t hash)
+{
+   uint32_t mask = contact_table.allocated - 1, i;
+
+   if (contact_table.allocated == 0)
+      return NULL;
+
+   for (i = hash & mask; contact_table.entry[i].id != NULL; i = (i+1) & mask)
+   {
+      contact_entry_t *entry = contact_table.entry + i;
+
+      if (   entry->id != contact_deleted
+          && entry->hash == hash
+          && entry->id_l == id_l
+          && !strncasecmp(entry->id, id, id_l))
+      {
+         return entry;
+      }
+   }
+
+   return NULL;
+}
+
+static int contact_resize(uint32_t allocate)
+{
+   contact_entry_t *entry = calloc(allocate, sizeof(contact_entry_t)),
+                   *old_entry = contact_table.entry;
+   uint32_t old_allocated = contact_table.allocated, i;
+
+   if (entry == NULL)
+   {
+      log_printf(LOG_ERROR, "contact_register:"
+         " Memory allocation failed (%u bytes)",
+         (unsigned int)(allocate * sizeof(contact_entry_t)));
+      return 0;
+   }
+
+   contact_table.entry = entry;
+   contact_table.allocated = allocate;
+   contact_table.deleted = 0;
+
+   for (i = 0; i < old_allocated; i++)
+   {
+      if (old_entry[i].id != NULL && old_entry[i].id != contact_deleted)
+      {
+         uint32_t j = old_entry[i].hash & (allocate - 1);
+         while (entry[j].id != NULL)
+            j = (j + 1) & (allocate - 1);
+         entry[j] = old_entry[i];
+      }
+   }
+
+   free(old_entry);
+   return 1;
+}
+
+int contact_lookup(const char *id, int id_l, contact_t *contact)
+{
+   contact_entry_t *entry;
+   int found = 0;
+
+   pthread_mutex_lock(&contact_table.mutex);
+
+   entry = contact_find(id, id_l, contact_hash(id, id_l));
+   if (entry != NULL)
+   {
+      *contact = entry->contact;
+      found = 1;
+   }
+
+   pthread_mutex_unlock(&contact_table.mutex);
+   return found;
+}
+
+int contact_register(const char *id, int id_l, const contact_t *contact)
+{
+   uint32_t hash = contact_hash(id, id_l), mask, i;
+   contact_entry_t *entry;
+   int ok = 0;
+
+   pthread_mutex_lock(&contact_table.mutex);
+
+   entry = contact_find(id, id_l, hash);
+   if (entry != NULL)
+   {
+      /* contact moved to a different client */
+      entry->contact = *contact;
+      ok = 1;
+      goto unlock;
+   }
+
+   if (   2 * (contact_table.used + contact_table.deleted + 1)
+        > contact_table.allocated)
+   {
+      uint32_t allocate = contact_table.allocated ? contact_table.allocated
+                                                  : CONTACT_TABLE_MIN;
+      while (4 * (contact_table.used + 1) > allocate)
+         allocate *= 2;
+
+      if (!contact_resize(allocate))
+         goto unlock;
+   }
+
+   mask = contact_table.allocated - 1;
+   for (i = hash & mask;
+        contact_table.entry[i].id != NULL
+     && contact_table.entry[i].id != contact_deleted;
+        i = (i + 1) & mask)
+   {
+      ;
+   }
+
+   entry = contact_table.entry + i;
+   if (entry->id == contact_deleted)
+      contact_table.deleted--;
+
+   entry->id = malloc(id_l);
+   if (entry->id == NULL)
+   {
+      log_printf(LOG_ERROR, "contact_register:"
+         " Memory allocation failed (%d bytes)", id_l);
+      goto unlock;
+   }
+
+   memcpy(entry->id, id, id_l);
+   entry->id_l = id_l;
+   entry->hash = hash;
+   entry->contact = *contact;
+   contact_table.used++;
+   ok = 1;
+
+unlock:
+   pthread_mutex_unlock(&contact_table.mutex);
+   return ok;
+}
+
+void contact_unregister(const char *id, int id_l, uint32_t client_id)
+{
+   contact_entry_t *entry;
+
+   pthread_mutex_lock(&contact_table.mutex);
+
+   entry = contact_find(id, id_l, contact_hash(id, id_l));
+   if (entry != NULL && entry->contact.client_id == client_id)
+   {
+      free(entry->id);
+      entry->id = contact_deleted;
+      contact_table.used--;
+      contact_table.deleted++;
+   }
+
+   pthread_mutex_unlock(&contact_table.mutex);
+}
+
+
+/* ------------------------------------------------------------------------
+   workers
+
+   Each worker runs its own event loop with its own server sockets
+   (SO_REUSEPORT) and clients. Messages to other workers are queued
+   in their inbox, which is signalled with an eventfd.
+
+   A worker failing stops all workers through their inbox, the main
+   thread joins them and reports the error.
+   ------------------------------------------------------------------------ */
+
+typedef struct
+{
+   pthread_t thread;
+   int started;                  /* thread created */
+   int ok;                       /* worker_main_t result */
+   int sfd;                      /* inbox eventfd */
+   pthread_mutex_t mutex;
+   worker_msg_t *head, *tail;
+}
+worker_t;
+
+static worker_t *worker;
+static __thread int worker_index;
+static int worker_stopping;
+
+int worker_self(void)
+{
+   return worker_index;
+}
+
+int worker_inbox_sfd(void)
+{
+   return worker ? worker[worker_index].sfd : -1;
+}
+
+int worker_post(int to_worker, worker_msg_t *msg)
+{
+   worker_t *w = worker + to_worker;
+   uint64_t one = 1;
+
+   assert(to_worker >= 0 && to_worker < options.workers);
+   msg->next = NULL;
+
+   pthread_mutex_lock(&w->mutex);
+   if (w->tail == NULL)
+      w->head = msg;
+   else
+      w->tail->next = msg;
+   w->tail = msg;
+   pthread_mutex_unlock(&w->mutex);
+
+   if (write(w->sfd, &one, sizeof(one)) == -1)
+   {
+      int err_no = errno;
+      log_printf(LOG_ERROR, "worker_post: "
+         "write [%d] %s", err_no, strerror(err_no));
+      return 0;
+   }
+
+   return 1;
+}
+
+void worker_inbox_event(int sfd, worker_msg_cb_t cb)
+{
+   worker_t *w = worker + worker_index;
+   worker_msg_t *msg;
+   uint64_t count;
+
+   if (read(sfd, &count, sizeof(count)) == -1)
+   {
+      int err_no = errno;
+      if (err_no != EAGAIN)
+      {
+         log_printf(LOG_ERROR, "worker_inbox_event: "
+            "read [%d] %s", err_no, strerror(err_no));
+      }
+   }
+
+   pthread_mutex_lock(&w->mutex);
+   msg = w->head;
+   w->head = w->tail = NULL;
+   pthread_mutex_unlock(&w->mutex);
+
+   while (msg != NULL)
+   {
+      worker_msg_t *next = msg->next;
+      cb(msg);
+      free(msg);
+      msg = next;
+   }
+}
+
+void worker_stop(void)
+{
+   /* inbox signalled to return from sfd_wait() */
+
+   uint64_t one = 1;
+   int i;
+
+   __atomic_store_n(&worker_stopping, 1, __ATOMIC_RELEASE);
+
+   for (i = 0; i < options.workers; i++)
+   {
+      if (worker[i].sfd != -1 && write(worker[i].sfd, &one, sizeof(one)) == -1)
+      {
+         int err_no = errno;
+         log_printf(LOG_ERROR, "worker_stop: "
+            "write [%d] %s", err_no, strerror(err_no));
+      }
+   }
+}
+
+int worker_stopped(void)
+{
+   return __atomic_load_n(&worker_stopping, __ATOMIC_ACQUIRE);
+}
+
+static worker_main_t worker_main_fn;
+
+static void *worker_start(void *arg)
+{
+   worker_index = (int)(intptr_t)arg;
+   worker[worker_index].ok = worker_main_fn(worker_index);
+
+   if (!worker[worker_index].ok)
+      worker_stop();
+
+   return NULL;
+}
+
+static void worker_cleanup(void)
+{
+   int i;
+
+   for (i = 0; i < options.workers; i++)
+   {
+      worker_msg_t *msg = worker[i].head;
+
+      while (msg != NULL)
+      {
+         worker_msg_t *next = msg->next;
+         free(msg);
+         msg = next;
+      }
+
+      if (worker[i].sfd != -1)
+         close(worker[i].sfd);
+      pthread_mutex_destroy(&worker[i].mutex);
+   }
+
+   free(worker);
+   worker = NULL;
+}
+
+int worker_run(worker_main_t main_fn)
+{
+   int i, ok;
+
+   worker = calloc(options.workers, sizeof(worker_t));
+   if (worker == NULL)
+   {
+      log_printf(LOG_ERROR, "worker_run:"
+         " Memory allocation failed (%u bytes)",
+         (unsigned int)(options.workers * sizeof(worker_t)));
+      return 0;
+   }
+
+   for (i = 0; i < options.workers; i++)
+   {
+      pthread_mutex_init(&worker[i].mutex, NULL);
+      worker[i].sfd = -1;
+   }
+
+   for (i = 0; i < options.workers; i++)
+   {
+      worker[i].sfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (worker[i].sfd == -1)
+      {
+         int err_no = errno;
+         log_printf(LOG_ERROR, "worker_run: "
+            "eventfd [%d] %s", err_no, strerror(err_no));
+         worker_cleanup();
+         return 0;
+      }
+   }
+
+   worker_main_fn = main_fn;
+   worker[0].ok = 1;
+
+   for (i = 1; i < options.workers; i++)
+   {
+      int err_no = pthread_create(&worker[i].thread, NULL,
+                                  worker_start, (void *)(intptr_t)i);
+      if (err_no)
+      {
+         log_printf(LOG_ERROR, "worker_run: "
+            "pthread_create [%d] %s", err_no, strerror(err_no));
+         worker[0].ok = 0;
+         worker_stop();
+         break;
+      }
+
+      worker[i].started = 1;
+   }
+
+   /* worker 0 runs on the main thread, until any worker stops */
+   if (worker[0].ok)
+      worker_start((void *)(intptr_t)0);
+   worker_stop();
+
+   ok = 1;
+   for (i = 0; i < options.workers; i++)
+   {
+      if (worker[i].started)
+         pthread_join(worker[i].thread, NULL);
+      if (i == 0 || worker[i].started)
+         ok &= worker[i].ok;
+   }
+
+   worker_cleanup();
+   return ok;
+}